@@ -8,11 +8,76 @@
 #include <linux/delay.h>
 #include <linux/mutex.h>
 #include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/if_arp.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define CHECK_BIT_VALUE(u8_val, bit_pos)  ( ((u8_val) >> (bit_pos)) & 0x1U )
 
 #define INIT_NRF24 _IO('G', 0)
+#define NRF24_SET_ESB _IOW('G', 1, struct nrf24_esb_config)
+#define NRF24_SET_ACK_PAYLOAD _IOW('G', 2, struct nrf24_ack_payload)
+#define NRF24_SET_DYNPD _IOW('G', 3, int)
+#define NRF24_SET_PIPE _IOW('G', 4, struct nrf24_pipe_config)
+#define NRF24_SET_FRAGMENT _IOW('G', 5, int)
+#define NRF24_SET_RF _IOW('G', 6, struct nrf24_rf_config)
+#define NRF24_SET_STANDBY _IOW('G', 7, int)
+#define NRF24_SET_READ_FORMAT _IOW('G', 8, int) /* NRF24_READ_RAW or NRF24_READ_META */
+#define NRF24_READ_RAW 0
+#define NRF24_READ_META 1
+#define NRF24_SET_SCHED _IOW('G', 9, struct nrf24_sched_config)
+#define NRF24_SCHED_TX_PRIORITY 0 /* A burst starts as soon as packets are queued. */
+#define NRF24_SCHED_SLOTS 1       /* Listening windows and bursts take turns. */
+#define NRF24_SET_POLL _IOW('G', 10, struct nrf24_poll_config)
 #define NRF24_MAX_PAYLOAD 32
+#define NRF24_PIPES 6
+#define NRF24_NUM_REGS 0x1E /* REG_CONFIG .. REG_FEATURE */
+#define NRF24_SPI_DEFAULT_HZ 1000000 /* Without spi-max-frequency in DT. */
+#define NRF24_SPI_MAX_HZ 10000000
+#define NRF24_MAX_CHANNEL 125
+#define NRF24_RX_QUEUE_LEN 64 /* Packets, must be power of 2. */
+#define NRF24_TX_QUEUE_LEN 64 /* Packets, must be power of 2. */
+#define NRF24_TX_TIMEOUT_MS 4 /* Max wait for TX_DS before the TX FIFO is dropped. */
+#define NRF24_POLL_US 200 /* STATUS poll period without IRQ line, default */
+#define NRF24_POLL_MAX_US 2000 /* Backoff limit of the poll period, default */
+#define NRF24_POLL_RX_TIMEOUT_US 10000 /* read() without IRQ line gives up after this, default */
+#define NRF24_POLL_MIN_US 10
+#define NRF24_POLL_LIMIT_US 100000 /* Longest poll period */
+#define NRF24_POLL_BUSY_LIMIT_US 1000 /* Longest busy-poll at the start of a read() */
+#define NRF24_ENGINE_MAX_ERRORS 3 /* SPI failures in a row before the engine gives up. */
+#define NRF24_ENGINE_RETRY_MS 100 /* Then STATUS is tried again after this. */
+#define NRF24_FRAG_HDR 4 /* sizeof(struct nrf24_frag_hdr) */
+#define NRF24_FRAG_DATA (NRF24_MAX_PAYLOAD - NRF24_FRAG_HDR)
+#define NRF24_FRAG_MAX_MSG 1024 /* Bytes per message, fits the TX queue. */
+#define NRF24_FRAG_TIMEOUT_MS 100 /* Max time between first and last fragment. */
+#define NRF24_MSG_QUEUE_LEN 2048 /* Bytes of whole messages per pipe, must be power of 2. */
+#define NRF24_HIST_BUCKETS 16 /* Latency histograms, bucket n counts [2^(n-1), 2^n) us. */
+#define NRF24_TX_FIFO_DEPTH 3
+#define NRF24_SETTLE_US 130 /* CE high to TX/RX ready */
+#define NRF24_SCHED_MAX_US 1000000 /* Longest slot or coalescing delay */
+#define NRF24_SEQ_MAX 24 /* Register writes per spi_message, a full reconfigure takes 22. */
+#define NRF24_RING_SLOTS 1024 /* mmap RX ring, must be power of 2. */
+#define NRF24_RING_SIZE (PAGE_SIZE + PAGE_ALIGN(NRF24_RING_SLOTS * sizeof(struct nrf24_ring_slot)))
+#define NRF24_BOND_MAX 4 /* Radios in the bond */
+#define NRF24_BOND_HDR 4 /* sizeof(struct nrf24_bond_hdr) */
+#define NRF24_BOND_DATA (NRF24_MAX_PAYLOAD - NRF24_BOND_HDR)
+#define NRF24_BOND_WINDOW 128 /* Reorder window in packets, must be power of 2. */
+#define NRF24_BOND_GAP_MS 50 /* A missing packet is given up after this. */
+#define NRF24_BOND_RX_LEN 8192 /* Bytes of the in order stream, must be power of 2. */
+#define NRF24_NET_MAX_FRAGS DIV_ROUND_UP(NRF24_FRAG_MAX_MSG, NRF24_FRAG_DATA) /* Per MTU sized packet */
 
 
 struct nrf24_config
@@ -22,14 +87,338 @@ struct nrf24_config
     u8 rx_address[5];
 };
 
+/* Enhanced ShockBurst: auto-ack, auto-retransmit and ACK payloads. */
+struct nrf24_esb_config
+{
+    u8 enable;         /* Auto-ack on all pipes, chip forces CRC on. */
+    u8 crc_bytes;      /* 0 (off), 1 or 2 */
+    u16 retr_delay_us; /* 250..4000, in 250us steps */
+    u8 retr_count;     /* 0..15, 0 means no retransmit */
+    u8 ack_payload;    /* Allow NRF24_SET_ACK_PAYLOAD, needs enable and dynamic payload length. */
+};
+
+/* Payload sent back inside the next ACK on given pipe (PRX side). */
+struct nrf24_ack_payload
+{
+    u8 pipe;
+    u8 len;
+    u8 data[32];
+};
+
+/* First page of the mmap RX ring. head and tail run freely, slot = index % slots.
+   Driver owns head, user space owns tail, each on its own cacheline. */
+struct nrf24_ring_hdr
+{
+    u32 slots;
+    u32 slot_size;
+    u32 head;
+    u32 reserved0[13];
+    u32 tail;
+    u32 reserved1[15];
+};
+
+/* Slots follow at offset PAGE_SIZE. */
+struct nrf24_ring_slot
+{
+    u64 timestamp_ns; /* CLOCK_MONOTONIC of the RX_DR interrupt */
+    u8 pipe;
+    u8 len;
+    u8 reserved[6];
+    u8 data[NRF24_MAX_PAYLOAD];
+};
+
+/* mmap RX ring, a mapping may outlive the device, so may this. */
+struct nrf24_ring
+{
+    struct kref ref; /* Device until remove, and every VMA */
+    spinlock_t lock; /* maps, head/tail reset against the producer */
+    int maps;
+    void *mem;       /* NRF24_RING_SIZE, vmalloc_user */
+};
+
+/* Air and bus settings, reset values of the chip are 2000 kbps, channel 2, 0 dBm. */
+struct nrf24_rf_config
+{
+    u32 spi_hz;         /* SPI clock, up to 10MHz */
+    u16 data_rate_kbps; /* 250, 1000 or 2000 */
+    u8 channel;         /* 0..125, 2400 + channel MHz */
+    s8 pa_dbm;          /* -18, -12, -6 or 0 */
+};
+
+/* Arbitration of the radio between listening and TX bursts. Every burst
+   costs 130us of settling on the way to PTX and back to PRX. */
+struct nrf24_sched_config
+{
+    u32 policy;      /* NRF24_SCHED_TX_PRIORITY or NRF24_SCHED_SLOTS */
+    u32 rx_slot_us;  /* SLOTS: listening time between two bursts */
+    u32 tx_slot_us;  /* SLOTS: longest burst, the TX FIFO drains after it */
+    u32 coalesce_us; /* A burst waits up to this for a full TX FIFO, 0 starts right away. */
+};
+
+/* Polling of STATUS on boards without the IRQ line. Periods start at
+   interval_us and double while nothing happens, up to max_interval_us. */
+struct nrf24_poll_config
+{
+    u32 interval_us;
+    u32 max_interval_us; /* interval_us for a fixed period */
+    u32 rx_timeout_us;   /* Deadline of read(), -ETIMEDOUT after it */
+    u32 busy_us;         /* read() spins instead of sleeping for this long, 0 never. */
+};
+
+/* RX pipe 0..5. Pipes 2..5 only use address[0], upper bytes are shared with pipe 1. */
+struct nrf24_pipe_config
+{
+    u8 pipe;
+    u8 enable;
+    u8 address[5];
+};
+
+struct nrf24_packet
+{
+    u8 len;
+    u8 data[NRF24_MAX_PAYLOAD];
+
+    /* RX only */
+    u8 pipe;
+    u8 flags;      /* NRF24_RX_DROPPED */
+    ktime_t stamp; /* RX_DR interrupt */
+};
+
+/* NRF24_READ_META: read() returns records of this header and len payload bytes. */
+struct nrf24_rx_meta
+{
+    u64 timestamp_ns; /* CLOCK_MONOTONIC of the RX_DR interrupt */
+    u8 pipe;
+    u8 len;
+    u8 flags;
+    u8 reserved[5];
+};
+#define NRF24_RX_DROPPED (1 << 0) /* The queue of the pipe dropped packets before this one. */
+
+/* In front of every payload when fragmentation is on. */
+struct nrf24_frag_hdr
+{
+    u8 id;    /* Message, wraps around */
+    u8 index; /* Fragment 0..count-1 */
+    u8 count;
+    u8 len;   /* Message bytes in this fragment, the rest is padding. */
+};
+
+/* In front of every payload sent through the bond. */
+struct nrf24_bond_hdr
+{
+    u8 session; /* New on every open() of the sender, seq starts at 0 then. */
+    __le16 seq; /* Stream position, wraps around */
+    u8 len;     /* Stream bytes in this packet, the rest is padding. */
+} __packed;
+
+/* Message being put together from the fragments of one pipe. */
+struct nrf24_reasm
+{
+    u8 id;
+    u8 count; /* 0 if nothing in progress */
+    u8 next;
+    u16 len;
+    unsigned long started; /* jiffies of the first fragment */
+    u8 data[NRF24_FRAG_MAX_MSG];
+};
+
+/* Every pipe has its own queue and a read-only node nrf24-<index>-pipe<n>. */
+struct nrf24_pipe
+{
+    struct nrf24 *nrf24;
+    struct miscdevice miscdev;
+    u8 index;
+    bool enabled;
+    u8 address[5];
+    DECLARE_KFIFO(rx_fifo, struct nrf24_packet, NRF24_RX_QUEUE_LEN);
+    bool dropped; /* rx_fifo was full, flagged on the next packet */
+
+    /* Fragmentation on: whole messages, one record each. */
+    struct nrf24_reasm reasm;
+    STRUCT_KFIFO_REC_2(NRF24_MSG_QUEUE_LEN) msg_fifo;
+};
+
+/* Step of the SPI state machine on the bus. */
+enum nrf24_op
+{
+    NRF24_OP_STATUS,      /* NOP, only clocks out STATUS */
+    NRF24_OP_CLEAR,       /* Write 1 to clear of the IRQ flags seen */
+    NRF24_OP_CONFIG,      /* PRX/PTX switch */
+    NRF24_OP_RX_WIDTH,
+    NRF24_OP_RX_PAYLOAD,
+    NRF24_OP_FLUSH_RX,
+    NRF24_OP_TX_PAYLOAD,
+    NRF24_OP_FLUSH_TX,
+    NRF24_OP_FIFO_STATUS,
+    NRF24_OP_OBSERVE_TX,  /* Retransmit and lost counters after TX_DS/MAX_RT */
+    NRF24_OP_RF_CH,       /* Rewrite of RF_CH, the only way to reset PLOS_CNT */
+};
+
+/* Register writes sent as one spi_message, CS goes high between the commands. */
+struct nrf24_reg_seq
+{
+    u8 buf[NRF24_SEQ_MAX][6]; /* W_REGISTER and up to 5 bytes */
+    u8 reg[NRF24_SEQ_MAX];
+    u8 len[NRF24_SEQ_MAX];
+    struct spi_transfer xfers[NRF24_SEQ_MAX];
+    unsigned int count;
+};
+
+/* Counters in /sys/kernel/debug/nrf24-<index>/stats, engine_lock protects them. */
+struct nrf24_stats
+{
+    u64 tx_packets;  /* Written to the TX FIFO */
+    u64 rx_packets;  /* Read from the RX FIFO */
+    u64 rx_dropped;  /* RX queue full */
+    u64 tx_timeouts;
+    u64 max_rt;
+    u64 retransmits; /* Sum of ARC_CNT */
+    u64 lost;        /* Sum of PLOS_CNT */
+    u64 spi_async;   /* Engine steps */
+    u64 spi_sync;    /* Transfers of the sync helpers, under nrf24->lock */
+    u64 tx_bursts;   /* PTX switches, tx_packets / tx_bursts is the coalescing */
+    u64 polls;       /* STATUS polls of a burst without IRQ line */
+    u32 tx_ds_hist[NRF24_HIST_BUCKETS];    /* TX FIFO write to TX_DS */
+    u32 irq_read_hist[NRF24_HIST_BUCKETS]; /* RX_DR interrupt to payload read */
+};
+
 struct nrf24
 {
     struct spi_device *device;
     struct miscdevice miscdev;
     struct gpio_desc *ce_gpio;
+    int ce; /* Last level driven on ce_gpio */
     struct nrf24_config config;
+    struct nrf24_esb_config esb;
+    struct nrf24_rf_config rf;
+    struct nrf24_sched_config sched; /* Under engine_lock */
+    struct nrf24_poll_config poll;   /* Under engine_lock and nrf24->lock */
+    bool dynpd; /* Dynamic payload length, also forced on by ESB ACK payloads. */
+    bool fragment; /* write()/read() move whole messages of up to NRF24_FRAG_MAX_MSG. */
+    bool read_meta; /* read() puts a struct nrf24_rx_meta in front of every packet. */
+    bool initialized; /* INIT_NRF24 done, registers reflect config. */
+    bool standby; /* Warm standby: release() leaves the chip powered up in Standby-I. */
+
+    /* Serialises the sync users of the chip (ioctl, open/release), see nrf24_lock(). */
+    struct mutex lock;
+
+    /* Shadow of the non volatile registers, written through and read without SPI. */
+    u8 shadow[NRF24_NUM_REGS][5];
+    u8 shadow_len[NRF24_NUM_REGS]; /* 0 if not cached */
+    struct dentry *debugfs;
+
+    /* IRQ line from DT, 0 if not wired. Then RX falls back to polling. */
+    int irq;
+    bool listening; /* PRX whenever no burst runs, RX FIFO drained by the engine. */
+
+    /* Packets drained from the RX FIFO, demuxed by pipe, consumed by read(). */
+    struct nrf24_pipe pipes[NRF24_PIPES];
+    spinlock_t rx_lock;
+    wait_queue_head_t rx_wq;
+    struct mutex msg_lock; /* Single consumer of the msg_fifos, copies straight to user. */
+
+    /* mmap RX ring, takes the place of the pipe queues while it is mapped. */
+    struct nrf24_ring *ring; /* Set under engine_lock, dropped on remove */
+
+    /* Optional network interface nrf<n>, IP packets fragmented like NRF24_SET_FRAGMENT. */
+    struct net_device *ndev;
+    struct napi_struct napi;
+    bool netdev_up; /* RX goes to NAPI through the pipe queues. */
+    bool napi_kick; /* Engine queued for NAPI, scheduled once engine_lock is dropped. */
+    bool bonded;    /* /dev/nrf24-bond is open, RX goes to its reorder window. */
+
+    /* Packets queued by write(), the engine keeps the 3-deep TX FIFO topped up. */
+    DECLARE_KFIFO(tx_fifo, struct nrf24_packet, NRF24_TX_QUEUE_LEN);
+    spinlock_t tx_lock;
+    wait_queue_head_t tx_wq;
+    u8 tx_msg_id;
+
+    /* spi_async engine, owns the chip while no sync user holds nrf24_lock(). */
+    spinlock_t engine_lock;
+    wait_queue_head_t engine_wq; /* Woken whenever the engine runs out of steps. */
+    struct spi_message engine_msg;
+    struct spi_transfer engine_xfer;
+    enum nrf24_op engine_op;
+    bool engine_busy; /* engine_msg on the bus */
+    int engine_errors;
+    bool quiesced;     /* No new burst or role switch, see nrf24_lock(). */
+    u8 status;         /* STATUS clocked out by the last step */
+    bool status_stale; /* IRQ, poll or a step changed it, the next step refreshes it. */
+    u8 clear_flags;    /* IRQ flags seen, not cleared yet */
+    u8 rx_len;         /* Width of the RX FIFO head, 0 if not read yet */
+    bool rx_more;      /* Payload just read, the next width read also tells RX_P_NO. */
+    bool rx_flush;
+    bool rx_mode;      /* PRX with CE high */
+    bool tx_active;    /* PTX, burst in progress */
+    bool tx_ce_high;
+    bool tx_inflight;  /* TX FIFO may hold packets. */
+    bool tx_full;
+    bool tx_flush;     /* MAX_RT or timeout, drop the TX FIFO. */
+    bool tx_check_fifo;
+    struct hrtimer tx_timer;
+    struct hrtimer poll_timer;
+    u32 poll_period;   /* us, current period of poll_timer */
+    bool poll_hit;     /* The last poll brought news, back to the shortest period. */
+    struct hrtimer sched_timer; /* Brings the engine back once a held burst may start. */
+    struct hrtimer retry_timer; /* Engine gave up, IRQ flags may be left set. */
+    struct hrtimer rx_wake_timer; /* No IRQ line, poll() looks at STATUS again. */
+    bool tx_waiting;   /* Packets queued, burst held back by the scheduler since tx_wait_since. */
+    ktime_t tx_wait_since;
+    ktime_t tx_since;  /* Start of the running burst */
+    ktime_t rx_since;  /* Start of the listening window */
+    bool tx_observe;   /* Read OBSERVE_TX for the stats. */
+    bool plos_reset;   /* PLOS_CNT saturated, rewrite RF_CH once CE is low. */
+    u8 plos_last;
+    ktime_t irq_stamp;
+    unsigned int irq_unstamped; /* IRQs since rx_stamp was last taken from irq_stamp */
+    ktime_t rx_stamp;  /* IRQ that came with the last RX_DR */
+    ktime_t tx_stamp[NRF24_TX_FIFO_DEPTH]; /* Write time of the packets in the TX FIFO, oldest first */
+    u8 tx_stamps;
+    struct nrf24_stats stats;
+    u8 sync_status;    /* STATUS clocked out by the last sync helper, under nrf24->lock */
+
+    /* DMA buffers of engine_xfer and, while quiesced, of the sync helpers.
+       Kept off the cachelines of the fields above. */
+    u8 tx_buf[NRF24_MAX_PAYLOAD + 1] ____cacheline_aligned;
+    u8 rx_buf[NRF24_MAX_PAYLOAD + 1] ____cacheline_aligned;
+
+    /* TX only DMA, under nrf24->lock. */
+    struct nrf24_reg_seq seq ____cacheline_aligned;
+};
+
+/* One logical link over every radio with nordic,bond. */
+struct nrf24_bond
+{
+    struct miscdevice miscdev;
+    struct nrf24 *members[NRF24_BOND_MAX];
+    unsigned int count;
+    bool open;
+    u8 tx_session;
+    u16 tx_seq;
+    unsigned int tx_next; /* Member the next packet goes to */
+    wait_queue_head_t tx_wq; /* Writer waits here, not on a member that may leave. */
+    atomic_t tx_room; /* Bumped whenever a member's TX queue got room. */
+
+    spinlock_t rx_lock;
+    wait_queue_head_t rx_wq;
+    struct mutex read_lock;
+    bool rx_synced;
+    u8 rx_session;
+    u16 rx_seq; /* Next one in order */
+    unsigned int rx_held; /* Packets waiting in rx_win */
+    struct nrf24_packet rx_win[NRF24_BOND_WINDOW]; /* len 0 if free */
+    DECLARE_KFIFO(rx_fifo, u8, NRF24_BOND_RX_LEN);
+    struct hrtimer gap_timer;
+    u64 rx_lost;    /* Given up on after NRF24_BOND_GAP_MS or out of the window */
+    u64 rx_dropped; /* In order stream full */
+    struct dentry *debugfs;
 };
 
+/* Members, open state and the position of the writer. */
+static DEFINE_MUTEX(nrf24_bond_lock);
+static struct nrf24_bond nrf24_bond;
+
 
 /* Commands */
 #define R_REGISTER          0x00   /* 0b000AAAAA, where AAAAA = reg address */
@@ -76,61 +465,247 @@ struct nrf24
 
 #define CONFIG_PRIM_RX    (1<<0)
 #define CONFIG_PWR_UP     (1<<1)
+#define CONFIG_CRCO       (1<<2)
+#define CONFIG_EN_CRC     (1<<3)
+
+#define RF_SETUP_LNA_HCURR  (1<<0) /* nRF24L01 LNA gain, don't care on the + */
+#define RF_SETUP_RF_PWR     (3<<1)
+#define RF_SETUP_RF_DR_HIGH (1<<3)
+#define RF_SETUP_RF_DR_LOW  (1<<5)
+
+#define FEATURE_EN_DYN_ACK (1<<0)
+#define FEATURE_EN_ACK_PAY (1<<1)
+#define FEATURE_EN_DPL     (1<<2)
+
+#define ALL_PIPES         0x3F
 
 #define STATUS_RX_DR      (1<<6)
 #define STATUS_TX_DS      (1<<5)
 #define STATUS_MAX_RT     (1<<4)
+#define STATUS_TX_FULL    (1<<0)
+
+#define STATUS_RX_P_NO    (7<<1) /* 7 = RX FIFO empty */
+
+#define OBSERVE_TX_ARC_CNT  0x0F
+#define OBSERVE_TX_PLOS_CNT 0xF0 /* Saturates at 15 */
+
+#define FIFO_STATUS_RX_EMPTY (1<<0)
+#define FIFO_STATUS_TX_EMPTY (1<<4)
+#define FIFO_STATUS_TX_FULL  (1<<5)
+
+
+
+static void nrf24_engine_complete(void *context);
+static void nrf24_bond_rx(const struct nrf24_packet *pkt);
+static void nrf24_bond_tx_wake(struct nrf24 *nrf24);
+
+/* Registers the chip changes on its own, never served from the shadow. */
+static bool nrf24_reg_volatile(u8 reg)
+{
+    return reg == REG_STATUS || reg == REG_OBSERVE_TX || reg == REG_CD ||
+           reg == REG_FIFO_STATUS || reg >= NRF24_NUM_REGS;
+}
+
+static void nrf24_shadow_invalidate(struct nrf24 *nrf24)
+{
+    memset(nrf24->shadow_len, 0, sizeof(nrf24->shadow_len));
+}
+
+static void nrf24_shadow_update(struct nrf24 *nrf24, u8 reg, const u8 *buf, size_t len)
+{
+    if (nrf24_reg_volatile(reg) || len > sizeof(nrf24->shadow[0]))
+        return;
+
+    memcpy(nrf24->shadow[reg], buf, len);
+    nrf24->shadow_len[reg] = len;
+}
+
+/* Caller must hold nrf24->lock, the engine is idle and its buffers are free.
+   One full-duplex transfer, the STATUS byte clocked out with cmd is kept in sync_status. */
+static int nrf24_command(struct nrf24 *nrf24, u8 cmd, const u8 *out, u8 *in, size_t len)
+{
+    struct spi_transfer xfer =
+    {
+        .tx_buf = nrf24->tx_buf,
+        .rx_buf = nrf24->rx_buf,
+        .len    = len + 1,
+    };
+    int ret;
+
+    if (len > NRF24_MAX_PAYLOAD)
+        return -EINVAL;
+
+    nrf24->tx_buf[0] = cmd;
+    if (out)
+        memcpy(&nrf24->tx_buf[1], out, len);
+    else
+        memset(&nrf24->tx_buf[1], NOP, len);
 
+    nrf24->stats.spi_sync++;
+    ret = spi_sync_transfer(nrf24->device, &xfer, 1);
+    if (ret)
+        return ret;
 
+    nrf24->sync_status = nrf24->rx_buf[0];
+    if (in)
+        memcpy(in, &nrf24->rx_buf[1], len);
+    return 0;
+}
 
+/* Caller must hold nrf24->lock. */
 static int nrf24_read_regs(struct nrf24 *nrf24, u8 start_reg,
                            u8 *buf, size_t len)
 {
-    struct spi_device *device = nrf24->device;
-    u8 cmd = R_REGISTER | (start_reg & 0x1F);
     int ret;
 
-    ret = spi_write_then_read(device, &cmd, 1, buf, len);
+    if (!nrf24_reg_volatile(start_reg) && len && nrf24->shadow_len[start_reg] >= len)
+    {
+        memcpy(buf, nrf24->shadow[start_reg], len);
+        return 0;
+    }
+
+    /* STATUS comes with every command, no register read needed. */
+    if (start_reg == REG_STATUS && len == 1)
+    {
+        ret = nrf24_command(nrf24, NOP, NULL, NULL, 0);
+        if (!ret)
+            *buf = nrf24->sync_status;
+        return ret;
+    }
+
+    ret = nrf24_command(nrf24, R_REGISTER | (start_reg & 0x1F), NULL, buf, len);
     if (ret)
         dev_err(nrf24->miscdev.this_device,
                 "Failed to read %zu bytes @0x%02x: %d\n",
                 len, start_reg, ret);
+    else
+        nrf24_shadow_update(nrf24, start_reg, buf, len);
     return ret;
 }
 
+/* Caller must hold nrf24->lock. Skips the bus if the shadow already holds buf. */
 static int nrf24_write_regs(struct nrf24 *nrf24,
                             u8 start_reg,
                             const u8 *buf,
                             size_t len)
 {
-    struct spi_device *device = nrf24->device;
-    u8 cmd = W_REGISTER | (start_reg & 0x1F);
-    struct spi_transfer xfers[] = 
-    {
-        {
-            .tx_buf = &cmd,
-            .len    = 1,
-        },
-        {
-            .tx_buf = buf,
-            .len    = len,
-        },
-    };
-    struct spi_message msg;
     int ret;
 
-    spi_message_init(&msg);
-    spi_message_add_tail(&xfers[0], &msg);
-    spi_message_add_tail(&xfers[1], &msg);
+    if (!nrf24_reg_volatile(start_reg) && nrf24->shadow_len[start_reg] == len &&
+        !memcmp(nrf24->shadow[start_reg], buf, len))
+        return 0;
 
-    ret = spi_sync(device, &msg);
+    ret = nrf24_command(nrf24, W_REGISTER | (start_reg & 0x1F), buf, NULL, len);
     if (ret)
+    {
         dev_err(nrf24->miscdev.this_device,
                 "Failed to write %zu bytes @0x%02x: %d\n",
                 len, start_reg, ret);
+        if (!nrf24_reg_volatile(start_reg))
+            nrf24->shadow_len[start_reg] = 0;
+    }
+    else
+        nrf24_shadow_update(nrf24, start_reg, buf, len);
+
+    /* Writing RF_CH resets PLOS_CNT. */
+    if (!ret && start_reg == REG_RF_CH)
+        nrf24->plos_last = 0;
+    return ret;
+}
+
+/* Caller must hold nrf24->lock. Starts an empty register sequence. */
+static void nrf24_seq_init(struct nrf24 *nrf24)
+{
+    nrf24->seq.count = 0;
+}
+
+/* Caller must hold nrf24->lock. Sends the queued writes in one spi_message. */
+static int nrf24_seq_submit(struct nrf24 *nrf24)
+{
+    struct nrf24_reg_seq *seq = &nrf24->seq;
+    unsigned int i, n = seq->count;
+    u8 reg;
+    int ret;
+
+    if (!n)
+        return 0;
+    seq->count = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        memset(&seq->xfers[i], 0, sizeof(seq->xfers[i]));
+        seq->xfers[i].tx_buf = seq->buf[i];
+        seq->xfers[i].len    = seq->len[i] + 1;
+        /* Every command starts with CS going low. */
+        seq->xfers[i].cs_change = i + 1 < n;
+    }
+
+    nrf24->stats.spi_sync++;
+    ret = spi_sync_transfer(nrf24->device, seq->xfers, n);
+    if (ret)
+        dev_err(nrf24->miscdev.this_device,
+                "Failed to write a sequence of %u registers: %d\n", n, ret);
+
+    for (i = 0; i < n; i++)
+    {
+        reg = seq->reg[i];
+        if (ret)
+        {
+            /* No telling how far it got. */
+            if (!nrf24_reg_volatile(reg))
+                nrf24->shadow_len[reg] = 0;
+            continue;
+        }
+
+        nrf24_shadow_update(nrf24, reg, &seq->buf[i][1], seq->len[i]);
+        if (reg == REG_RF_CH)
+            nrf24->plos_last = 0;
+    }
+
     return ret;
 }
 
+/* Caller must hold nrf24->lock. Queues a register write, skipped if the shadow
+   already holds buf. A full sequence is sent on the spot. */
+static int nrf24_seq_write(struct nrf24 *nrf24, u8 reg, const u8 *buf, size_t len)
+{
+    struct nrf24_reg_seq *seq = &nrf24->seq;
+    int ret;
+
+    if (len > sizeof(seq->buf[0]) - 1)
+        return -EINVAL;
+
+    if (!nrf24_reg_volatile(reg) && nrf24->shadow_len[reg] == len &&
+        !memcmp(nrf24->shadow[reg], buf, len))
+        return 0;
+
+    if (seq->count == NRF24_SEQ_MAX)
+    {
+        ret = nrf24_seq_submit(nrf24);
+        if (ret) return ret;
+    }
+
+    seq->buf[seq->count][0] = W_REGISTER | (reg & 0x1F);
+    memcpy(&seq->buf[seq->count][1], buf, len);
+    seq->reg[seq->count] = reg;
+    seq->len[seq->count] = len;
+    seq->count++;
+
+    return 0;
+}
+
+static bool nrf24_dpl_enabled(struct nrf24 *nrf24)
+{
+    return nrf24->dynpd || nrf24->esb.ack_payload;
+}
+
+/* Any context, the pin must not sleep. The level is kept for debugfs. */
+static void nrf24_set_ce(struct nrf24 *nrf24, int value)
+{
+    WRITE_ONCE(nrf24->ce, value);
+    gpiod_set_value(nrf24->ce_gpio, value);
+}
+
 static int nrf24_set_mode(struct nrf24 *nrf24, bool rx)
 {
     u8 cfg;
@@ -150,85 +725,42 @@ static int nrf24_set_mode(struct nrf24 *nrf24, bool rx)
     return 0;
 }
 
-static int nrf24_send(struct nrf24 *nrf24, const u8 *data, size_t len)
+/* nrf24->lock held. Polls STATUS until RX_DR or poll.rx_timeout_us, spinning
+   for the first poll.busy_us, then sleeping with backoff. */
+static int nrf24_poll_rx_ready(struct nrf24 *nrf24)
 {
-    int ret;
-    u8 status;
-    struct spi_device *device = nrf24->device;
-    u8 cmd;
-
-    /* TX mode */
-    ret = nrf24_set_mode(nrf24, false);
-    if (ret) 
-    {
-        dev_err(nrf24->miscdev.this_device, "set_mode(TX) failed: %d\n", ret);
-        return ret;
-    }
-
-    /* Clear any old IRQ flags (TX_DS, MAX_RT) */
-    status = STATUS_TX_DS | STATUS_MAX_RT;
-    ret = nrf24_write_regs(nrf24, REG_STATUS, &status, 1);
-    if (ret) 
-    {
-        dev_err(nrf24->miscdev.this_device, "Clearing STATUS failed: %d\n", ret);
-        return ret;
-    }
-
-    cmd = FLUSH_TX;
-    ret = spi_write(device, &cmd, 1);
-    if (ret) 
-    {
-        dev_err(nrf24->miscdev.this_device, "FLUSH_TX failed: %d\n", ret);
-        return ret;
-    }
+    const struct nrf24_poll_config *pc = &nrf24->poll;
+    ktime_t start = ktime_get();
+    u32 period = pc->interval_us;
+    s64 elapsed;
 
-    /* Write the payload in one go: [W_TX_PAYLOAD][data...] */
-    u8 txbuf[NRF24_MAX_PAYLOAD + 1];
-    txbuf[0] = W_TX_PAYLOAD;
-    memcpy(&txbuf[1], data, len);
-    ret = spi_write(device, txbuf, len + 1);
-    if (ret) 
+    for (;;)
     {
-        dev_err(nrf24->miscdev.this_device, "W_TX_PAYLOAD failed: %d\n", ret);
-        return ret;
-    }
-
-    /* Drive CE accordingly */
-    gpiod_set_value(nrf24->ce_gpio, 1);
+        /* A NOP is the shortest way to STATUS. */
+        if (!nrf24_command(nrf24, NOP, NULL, NULL, 0) &&
+            CHECK_BIT_VALUE(nrf24->sync_status, 6))
+        {
+            return 0;
+        }
 
-    /* It takes 130us until TX mode is ready. */
-    usleep_range(130, 140);
+        elapsed = ktime_us_delta(ktime_get(), start);
+        if (elapsed >= pc->rx_timeout_us)
+            return -ETIMEDOUT;
 
-    /* Try for 4 ms. */
-    int counter = 4;
-    while (counter > 0)
-    {
-        u8 value;
-        nrf24_read_regs(nrf24, REG_STATUS, &value, 1);
-        if (CHECK_BIT_VALUE(value, 5)) // TX_DS pos is 5.
-            break;
+        if (elapsed < pc->busy_us)
+        {
+            udelay(min_t(u32, pc->interval_us, pc->busy_us - elapsed));
+            continue;
+        }
 
-        counter--;
-        msleep(1);
+        usleep_range(period, period + period / 4);
+        period = min(period * 2, pc->max_interval_us);
     }
-
-    if (counter <= 0)
-        dev_err(nrf24->miscdev.this_device, "Transmittion failed.\n");
-
-    /* Device should not stay in tx mode then 4 ms.*/
-    gpiod_set_value(nrf24->ce_gpio, 0); 
-
-    nrf24_read_regs(nrf24, REG_STATUS, &status, 1);
-    status &= ~STATUS_TX_DS;
-    nrf24_write_regs(nrf24, REG_STATUS, &status, 1);
-
-    return ret;
 }
 
 static int nrf24_receive(struct nrf24 *nrf24, u8 *data, size_t len)
 {
-    struct spi_device *device = nrf24->device;
-    u8 status, cmd;
+    u8 status;
     int ret;
     
     /* TX mode  */
@@ -236,36 +768,25 @@ static int nrf24_receive(struct nrf24 *nrf24, u8 *data, size_t len)
     if (ret) return ret;
 
     /* CE 1 */
-    gpiod_set_value(nrf24->ce_gpio, 1);
+    nrf24_set_ce(nrf24, 1);
 
     /* It takes 130us until RX mode is ready. */
-    usleep_range(130, 140);
-
-    int counter = 10;
-    while (counter > 0)
-    {
-        nrf24_read_regs(nrf24, REG_STATUS, &status, 1);
-        if (CHECK_BIT_VALUE(status, 6)) 
-        {
-            break;
-        }
-        msleep(1);
-        counter--;
-    }
+    usleep_range(NRF24_SETTLE_US, NRF24_SETTLE_US + 10);
 
-    if (counter <= 0)
-        dev_err(nrf24->miscdev.this_device, "There is no ready data in RX FIFO.\n");
+    ret = nrf24_poll_rx_ready(nrf24);
+    if (ret)
+        dev_dbg(nrf24->miscdev.this_device, "There is no ready data in RX FIFO.\n");
     else
     {
-        cmd = R_RX_PAYLOAD;
-        ret = spi_write_then_read(device, &cmd, 1, data, len);
+        ret = nrf24_command(nrf24, R_RX_PAYLOAD, NULL, data, len);
         if (ret) 
         {
             dev_err(nrf24->miscdev.this_device, "Error reading RX FIFO.\n");
         }
         else
         {
-            status |= STATUS_RX_DR;
+            /* Clear only RX_DR, TX flags are not ours to drop. */
+            status = STATUS_RX_DR;
             nrf24_write_regs(nrf24, REG_STATUS, &status, 1);
         }
     }
@@ -275,176 +796,3233 @@ static int nrf24_receive(struct nrf24 *nrf24, u8 *data, size_t len)
        So we need receiver always in RX mode. */
     //gpiod_set_value(nrf24->ce_gpio, 0);
 
-    return 0;
+    return ret;
 }
 
-static int nrf24_init_defaults(struct nrf24 *nrf24)
+/* nrf24->lock held. A single look at STATUS: 1 with a packet in the RX FIFO,
+   0 without one, the chip is then left listening for the next look. */
+static int nrf24_rx_check(struct nrf24 *nrf24)
 {
     int ret;
-    u8 tmp;
 
-    /* Disable auto ack */
-    tmp = 0;
-    ret = nrf24_write_regs(nrf24, REG_EN_AA, &tmp, 1);
+    ret = nrf24_command(nrf24, NOP, NULL, NULL, 0);
     if (ret) return ret;
 
-    /* Address width = 5 bytes */
-    tmp = 0x03;
-    ret = nrf24_write_regs(nrf24, REG_SETUP_AW, &tmp, 1);
-    if (ret) return ret;
+    if (CHECK_BIT_VALUE(nrf24->sync_status, 6))
+        return 1;
 
-    /* Fixed payload length = 32 on P0 */
-    tmp = 32;
-    ret = nrf24_write_regs(nrf24, REG_RX_PW_P0, &tmp, 1);
+    ret = nrf24_set_mode(nrf24, true);
     if (ret) return ret;
 
-    /* CONFIG: PWR_UP, DISABLE CRC */
-    tmp = 0;
-    tmp |= CONFIG_PWR_UP;
-    ret = nrf24_write_regs(nrf24, REG_CONFIG, &tmp, 1);
-    if (ret) return ret;
+    nrf24_set_ce(nrf24, 1);
+    return 0;
+}
+
+/* nrf24->lock held. nrf24_receive() for non-blocking readers, -EAGAIN instead of waiting. */
+static int nrf24_receive_nowait(struct nrf24 *nrf24, u8 *data, size_t len)
+{
+    u8 status;
+    int ret;
 
-    msleep(2); /* From power down to standby-1 mode, 1.5ms is required. */
+    ret = nrf24_rx_check(nrf24);
+    if (ret < 0) return ret;
+    if (!ret) return -EAGAIN;
 
-    return ret;
+    ret = nrf24_command(nrf24, R_RX_PAYLOAD, NULL, data, len);
+    if (ret) return ret;
+
+    status = STATUS_RX_DR;
+    return nrf24_write_regs(nrf24, REG_STATUS, &status, 1);
 }
 
-static int nrf24_open(struct inode *inode, struct file *file)
+/* True if any pipe in the mask has a packet queued. */
+static bool nrf24_rx_pending(struct nrf24 *nrf24, u8 pipes)
 {
-    struct miscdevice *misc = file->private_data;
-    struct nrf24 *nrf24 = container_of(misc, struct nrf24, miscdev);
-    int ret = 0; 
-    // Set nrf24 struct as private data, it is needed in write/read to have spi_device.
-    file->private_data = nrf24;
+    int i;
 
-    /* Power down, it will be power up in init. */
-    u8 tmp = 0;
-    ret = nrf24_write_regs(nrf24, REG_CONFIG, &tmp, 1);
-    if (ret) return ret;
-    return ret;
+    for (i = 0; i < NRF24_PIPES; i++)
+        if ((pipes & (1 << i)) &&
+            (!kfifo_is_empty(&nrf24->pipes[i].rx_fifo) || !kfifo_is_empty(&nrf24->pipes[i].msg_fifo)))
+            return true;
+
+    return false;
 }
 
-static int nrf24_release(struct inode *inode, struct file *file)
+/* Takes one packet from the lowest pipe in the mask that has one. */
+static bool nrf24_rx_get(struct nrf24 *nrf24, u8 pipes, struct nrf24_packet *pkt)
 {
-    struct nrf24 *nrf24 = file->private_data;
-    u8 tmp = 0;
-    int ret = 0;
+    int i;
 
-    /* CE 0 */
-    gpiod_set_value(nrf24->ce_gpio, 0);
+    for (i = 0; i < NRF24_PIPES; i++)
+        if ((pipes & (1 << i)) &&
+            kfifo_out_spinlocked(&nrf24->pipes[i].rx_fifo, pkt, 1, &nrf24->rx_lock))
+            return true;
 
-    /* Power down */
-    ret = nrf24_write_regs(nrf24, REG_CONFIG, &tmp, 1);
-    if (ret) return ret;
-    return 0;
+    return false;
 }
 
-static long nrf24_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static void nrf24_rx_reset(struct nrf24 *nrf24)
 {
-    struct nrf24 *nrf24 = file->private_data;
-    int ret = 0;
+    int i;
 
-    switch (cmd)
-    {
-    case INIT_NRF24:
+    mutex_lock(&nrf24->msg_lock);
+    spin_lock_irq(&nrf24->engine_lock);
+    spin_lock(&nrf24->rx_lock);
+    for (i = 0; i < NRF24_PIPES; i++)
     {
-        int bytes = copy_from_user(&nrf24->config, (struct nrf24_config *)arg, sizeof(struct nrf24_config));
-        if (bytes < 0)
-            return -EFAULT; // Bad address.
+        kfifo_reset(&nrf24->pipes[i].rx_fifo);
+        kfifo_reset(&nrf24->pipes[i].msg_fifo);
+        nrf24->pipes[i].reasm.count = 0;
+    }
+    spin_unlock(&nrf24->rx_lock);
+    spin_unlock_irq(&nrf24->engine_lock);
+    mutex_unlock(&nrf24->msg_lock);
+}
 
-        // If it is 0 which means module is transmitter and needs CE.
-        nrf24->ce_gpio = gpio_to_desc(nrf24->config.ce_gpio);
-        if (!nrf24->ce_gpio)
+/* Adds one fragment, true once r->data holds the complete message.
+   Called by the engine, or by NAPI while the netdev is up. */
+static bool nrf24_reasm_add(struct nrf24 *nrf24, struct nrf24_pipe *pipe,
+                            const struct nrf24_packet *pkt)
+{
+    const struct nrf24_frag_hdr *hdr = (const struct nrf24_frag_hdr *)pkt->data;
+    struct nrf24_reasm *r = &pipe->reasm;
+    struct device *dev = nrf24->miscdev.this_device;
+
+    if (pkt->len < NRF24_FRAG_HDR || hdr->index >= hdr->count ||
+        hdr->len > pkt->len - NRF24_FRAG_HDR)
+    {
+        dev_warn_ratelimited(dev, "Bad fragment on pipe %u dropped.\n", pipe->index);
+        return false;
+    }
+
+    /* A new message or a stale one means fragments of the old one got lost. */
+    if (r->count && (hdr->id != r->id ||
+                     time_after(jiffies, r->started + msecs_to_jiffies(NRF24_FRAG_TIMEOUT_MS))))
+    {
+        dev_warn_ratelimited(dev, "Incomplete message %u on pipe %u dropped (%u/%u).\n",
+                             r->id, pipe->index, r->next, r->count);
+        r->count = 0;
+    }
+
+    if (!r->count)
+    {
+        /* Rest of a message whose start is gone. */
+        if (hdr->index)
+            return false;
+
+        r->id = hdr->id;
+        r->count = hdr->count;
+        r->next = 0;
+        r->len = 0;
+        r->started = jiffies;
+    }
+
+    if (hdr->index != r->next || hdr->count != r->count ||
+        r->len + hdr->len > NRF24_FRAG_MAX_MSG)
+    {
+        dev_warn_ratelimited(dev, "Fragment %u of message %u on pipe %u lost.\n",
+                             r->next, r->id, pipe->index);
+        r->count = 0;
+        return false;
+    }
+
+    memcpy(r->data + r->len, pkt->data + NRF24_FRAG_HDR, hdr->len);
+    r->len += hdr->len;
+    if (++r->next < r->count)
+        return false;
+
+    r->count = 0;
+    return true;
+}
+
+/* engine_lock held. Fragment for a reader of whole messages. */
+static void nrf24_msg_rx(struct nrf24 *nrf24, struct nrf24_pipe *pipe,
+                         const struct nrf24_packet *pkt)
+{
+    struct nrf24_reasm *r = &pipe->reasm;
+
+    if (!nrf24_reasm_add(nrf24, pipe, pkt))
+        return;
+
+    if (kfifo_in_spinlocked(&pipe->msg_fifo, r->data, r->len, &nrf24->rx_lock))
+        wake_up_interruptible(&nrf24->rx_wq);
+    else
+        dev_warn_ratelimited(nrf24->miscdev.this_device,
+                             "Message queue of pipe %u full, message dropped.\n",
+                             pipe->index);
+}
+
+/* Header and padding around the len message bytes at data + NRF24_FRAG_HDR.
+   The id is set when the fragments are queued. */
+static void nrf24_frag_fill(struct nrf24 *nrf24, struct nrf24_packet *pkt,
+                            u8 index, u8 count, size_t len)
+{
+    struct nrf24_frag_hdr *hdr = (struct nrf24_frag_hdr *)pkt->data;
+
+    hdr->index = index;
+    hdr->count = count;
+    hdr->len = len;
+
+    /* Fixed width receivers expect the full payload, pad it. */
+    pkt->len = NRF24_FRAG_HDR + len;
+    if (!nrf24_dpl_enabled(nrf24))
+    {
+        memset(pkt->data + pkt->len, 0, NRF24_MAX_PAYLOAD - pkt->len);
+        pkt->len = NRF24_MAX_PAYLOAD;
+    }
+}
+
+/* Netdev queue is stopped while an MTU sized packet would not fit the TX queue. */
+static void nrf24_net_tx_wake(struct nrf24 *nrf24)
+{
+    if (nrf24->ndev && netif_queue_stopped(nrf24->ndev) &&
+        kfifo_avail(&nrf24->tx_fifo) >= NRF24_NET_MAX_FRAGS)
+        netif_wake_queue(nrf24->ndev);
+}
+
+/* Worst case time the chip spends retransmitting one packet before MAX_RT. */
+static unsigned int nrf24_retransmit_ms(struct nrf24 *nrf24)
+{
+    if (!nrf24->esb.enable)
+        return 0;
+
+    return DIV_ROUND_UP(nrf24->esb.retr_delay_us * (nrf24->esb.retr_count + 1), 1000);
+}
+
+/*
+ * Hot path state machine. Every step is a single full duplex spi_async transfer
+ * [cmd][data], the first byte clocked back is STATUS. The completion of one step
+ * picks and submits the next one, the IRQ, write() and the timers only kick it.
+ * Nothing here sleeps, the state is protected by engine_lock.
+ */
+
+/* engine_lock held. True while the mmap ring takes the place of the pipe queues. */
+static bool nrf24_ring_mapped(struct nrf24 *nrf24)
+{
+    return nrf24->ring && READ_ONCE(nrf24->ring->maps);
+}
+
+/* engine_lock held. Producer side of the mmap ring. */
+static void nrf24_ring_put(struct nrf24 *nrf24, u8 pipe, const struct nrf24_packet *pkt)
+{
+    struct nrf24_ring *ring = nrf24->ring;
+    struct nrf24_ring_hdr *hdr = ring->mem;
+    struct nrf24_ring_slot *slot;
+    u32 head, tail;
+
+    spin_lock(&ring->lock);
+    /* Last mapping went away since the caller looked. */
+    if (!ring->maps)
+    {
+        spin_unlock(&ring->lock);
+        nrf24->stats.rx_dropped++;
+        return;
+    }
+
+    head = hdr->head;
+    tail = smp_load_acquire(&hdr->tail);
+    if (head - tail >= NRF24_RING_SLOTS)
+    {
+        spin_unlock(&ring->lock);
+        nrf24->stats.rx_dropped++;
+        dev_warn_ratelimited(nrf24->miscdev.this_device, "RX ring full, packet dropped.\n");
+        return;
+    }
+
+    slot = (struct nrf24_ring_slot *)(ring->mem + PAGE_SIZE) + (head & (NRF24_RING_SLOTS - 1));
+    slot->timestamp_ns = ktime_to_ns(pkt->stamp);
+    slot->pipe = pipe;
+    slot->len = pkt->len;
+    memcpy(slot->data, pkt->data, pkt->len);
+    smp_store_release(&hdr->head, head + 1);
+    spin_unlock(&ring->lock);
+
+    /* Consumer only sleeps in poll() when it found the ring empty. */
+    if (head == tail)
+        wake_up_interruptible(&nrf24->rx_wq);
+}
+
+static bool nrf24_ring_pending(struct nrf24 *nrf24)
+{
+    struct nrf24_ring *ring = READ_ONCE(nrf24->ring);
+    struct nrf24_ring_hdr *hdr;
+
+    if (!ring || !READ_ONCE(ring->maps))
+        return false;
+
+    hdr = ring->mem;
+    return smp_load_acquire(&hdr->head) != READ_ONCE(hdr->tail);
+}
+
+/* engine_lock held. Counts the time since start in a log2 microsecond bucket. */
+static void nrf24_hist_add(u32 *hist, ktime_t start)
+{
+    s64 us = ktime_us_delta(ktime_get(), start);
+
+    hist[us > 0 ? min_t(int, fls64(us), NRF24_HIST_BUCKETS - 1) : 0]++;
+}
+
+/* engine_lock held, bus idle. */
+static void nrf24_engine_prep(struct nrf24 *nrf24, enum nrf24_op op, u8 cmd,
+                              const u8 *data, size_t len)
+{
+    struct spi_transfer *xfer = &nrf24->engine_xfer;
+
+    nrf24->tx_buf[0] = cmd;
+    if (data)
+        memcpy(&nrf24->tx_buf[1], data, len);
+    else
+        memset(&nrf24->tx_buf[1], NOP, len);
+
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->tx_buf = nrf24->tx_buf;
+    xfer->rx_buf = nrf24->rx_buf;
+    xfer->len    = len + 1;
+    spi_message_init_with_transfers(&nrf24->engine_msg, xfer, 1);
+    nrf24->engine_msg.complete = nrf24_engine_complete;
+    nrf24->engine_msg.context  = nrf24;
+
+    nrf24->engine_op   = op;
+    nrf24->engine_busy = true;
+    nrf24->stats.spi_async++;
+
+    /* STATUS comes out with the first byte of this step, later than whatever made it stale. */
+    nrf24->status_stale = false;
+}
+
+/* engine_lock held. PRX/PTX switch from the shadow CONFIG, false if already there. */
+static bool nrf24_engine_config(struct nrf24 *nrf24, bool rx)
+{
+    u8 cfg = nrf24->shadow[REG_CONFIG][0];
+
+    if (rx)
+        cfg |= CONFIG_PRIM_RX;
+    else
+        cfg &= ~CONFIG_PRIM_RX;
+
+    if (cfg == nrf24->shadow[REG_CONFIG][0])
+        return false;
+
+    nrf24_engine_prep(nrf24, NRF24_OP_CONFIG, W_REGISTER | REG_CONFIG, &cfg, 1);
+    return true;
+}
+
+static void nrf24_tx_timer_start(struct nrf24 *nrf24)
+{
+    unsigned int ms = NRF24_TX_TIMEOUT_MS + nrf24_retransmit_ms(nrf24);
+
+    hrtimer_start(&nrf24->tx_timer, ms_to_ktime(ms), HRTIMER_MODE_REL);
+}
+
+/* engine_lock held. Leaves PTX, the RX part of nrf24_engine_next() goes back to PRX. */
+static void nrf24_tx_end(struct nrf24 *nrf24)
+{
+    nrf24_set_ce(nrf24, 0);
+    nrf24->tx_active     = false;
+    nrf24->tx_ce_high    = false;
+    nrf24->tx_inflight   = false;
+    nrf24->tx_full       = false;
+    nrf24->tx_flush      = false;
+    nrf24->tx_check_fifo = false;
+    nrf24->tx_stamps     = 0;
+    hrtimer_try_to_cancel(&nrf24->tx_timer);
+
+    wake_up_interruptible(&nrf24->tx_wq);
+}
+
+/* engine_lock held. The running burst reached the end of its TX slot. */
+static bool nrf24_sched_tx_over(struct nrf24 *nrf24)
+{
+    return nrf24->sched.policy == NRF24_SCHED_SLOTS &&
+           ktime_us_delta(ktime_get(), nrf24->tx_since) >= nrf24->sched.tx_slot_us;
+}
+
+/* engine_lock held, tx_fifo not empty. Whether a burst may start now,
+   if not sched_timer runs the engine again when it may. */
+static bool nrf24_sched_tx_ready(struct nrf24 *nrf24)
+{
+    const struct nrf24_sched_config *sc = &nrf24->sched;
+    ktime_t now = ktime_get();
+    ktime_t at = now;
+    ktime_t rx_end;
+
+    if (!nrf24->tx_waiting)
+    {
+        nrf24->tx_waiting = true;
+        nrf24->tx_wait_since = now;
+    }
+
+    /* Settling is paid once for as many packets as the TX FIFO takes. */
+    if (sc->coalesce_us && kfifo_len(&nrf24->tx_fifo) < NRF24_TX_FIFO_DEPTH)
+        at = ktime_add_us(nrf24->tx_wait_since, sc->coalesce_us);
+
+    /* The listening window after a burst is kept whatever is queued.
+       Right after a burst it starts with the switch to PRX below. */
+    if (sc->policy == NRF24_SCHED_SLOTS && nrf24->listening)
+    {
+        rx_end = ktime_add_us(nrf24->rx_mode ? nrf24->rx_since : now, sc->rx_slot_us);
+        if (ktime_after(rx_end, at))
+            at = rx_end;
+    }
+
+    if (ktime_after(at, now))
+    {
+        hrtimer_start(&nrf24->sched_timer, at, HRTIMER_MODE_ABS);
+        return false;
+    }
+
+    nrf24->tx_waiting = false;
+    return true;
+}
+
+/* engine_lock held, bus idle. Prepares the next step, false if there is nothing to do. */
+static bool nrf24_engine_next(struct nrf24 *nrf24)
+{
+    struct nrf24_packet pkt;
+    u8 cmd, pipe;
+
+    /* Chip belongs to a sync caller once the running burst is over. */
+    if (nrf24->quiesced && !nrf24->tx_active)
+        return false;
+
+    /* Steps that don't depend on STATUS go first, each brings a fresh one along. */
+
+    /* Flags are write 1 to clear, clear only what was seen. */
+    if (nrf24->clear_flags)
+    {
+        nrf24_engine_prep(nrf24, NRF24_OP_CLEAR, W_REGISTER | REG_STATUS,
+                          &nrf24->clear_flags, 1);
+        return true;
+    }
+
+    if (nrf24->rx_flush)
+    {
+        nrf24_engine_prep(nrf24, NRF24_OP_FLUSH_RX, FLUSH_RX, NULL, 0);
+        return true;
+    }
+
+    /* Reads the width of a packet that may not be there, STATUS decides. */
+    if (nrf24->rx_more)
+    {
+        nrf24_engine_prep(nrf24, NRF24_OP_RX_WIDTH, R_RX_PL_WID, NULL, 1);
+        return true;
+    }
+
+    /* Nothing else to send, a NOP is the shortest way to STATUS. */
+    if (nrf24->status_stale)
+    {
+        nrf24_engine_prep(nrf24, NRF24_OP_STATUS, NOP, NULL, 0);
+        return true;
+    }
+
+    /* RX first, RX_P_NO tells both whether the FIFO is empty and where the head came from. */
+    pipe = (nrf24->status & STATUS_RX_P_NO) >> 1;
+    if (pipe < NRF24_PIPES)
+    {
+        if (nrf24_dpl_enabled(nrf24) && !nrf24->rx_len)
+        {
+            nrf24_engine_prep(nrf24, NRF24_OP_RX_WIDTH, R_RX_PL_WID, NULL, 1);
+            return true;
+        }
+
+        nrf24_engine_prep(nrf24, NRF24_OP_RX_PAYLOAD, R_RX_PAYLOAD, NULL,
+                          nrf24->rx_len ? nrf24->rx_len : NRF24_MAX_PAYLOAD);
+        return true;
+    }
+
+    if (nrf24->tx_observe)
+    {
+        nrf24->tx_observe = false;
+        nrf24_engine_prep(nrf24, NRF24_OP_OBSERVE_TX, R_REGISTER | REG_OBSERVE_TX, NULL, 1);
+        return true;
+    }
+
+    if (nrf24->tx_active)
+    {
+        if (nrf24->tx_flush)
+        {
+            nrf24_engine_prep(nrf24, NRF24_OP_FLUSH_TX, FLUSH_TX, NULL, 0);
+            return true;
+        }
+
+        if (!nrf24->tx_full && !nrf24->quiesced && !nrf24_sched_tx_over(nrf24) &&
+            kfifo_out_spinlocked(&nrf24->tx_fifo, &pkt, 1, &nrf24->tx_lock))
+        {
+            /* Dynamic payloads need EN_AA, without ESB nobody should wait for an ACK. */
+            cmd = W_TX_PAYLOAD;
+            if (nrf24->dynpd && !nrf24->esb.enable)
+                cmd = W_TX_PAYLOAD_NOACK;
+            nrf24_engine_prep(nrf24, NRF24_OP_TX_PAYLOAD, cmd, pkt.data, pkt.len);
+            wake_up_interruptible(&nrf24->tx_wq);
+            nrf24_net_tx_wake(nrf24);
+            nrf24_bond_tx_wake(nrf24);
+            return true;
+        }
+
+        if (nrf24->tx_inflight)
+        {
+            /* CE stays high for the whole burst, the chip sends as long as the FIFO has data. */
+            if (!nrf24->tx_ce_high)
+            {
+                nrf24_set_ce(nrf24, 1);
+                nrf24->tx_ce_high = true;
+            }
+
+            if (!nrf24->tx_check_fifo)
+                return false; /* Until TX_DS, MAX_RT or the timeout. */
+
+            nrf24->tx_check_fifo = false;
+            nrf24_engine_prep(nrf24, NRF24_OP_FIFO_STATUS, R_REGISTER | REG_FIFO_STATUS, NULL, 1);
+            return true;
+        }
+
+        /* TX FIFO is empty and the queue too, or a sync caller waits. */
+        nrf24_tx_end(nrf24);
+        if (nrf24->quiesced)
+            return false;
+    }
+
+    /* CONFIG is unknown until the first open(), nothing to drive yet. */
+    if (nrf24->quiesced || !nrf24->shadow_len[REG_CONFIG])
+        return false;
+
+    /* Registers may only be written with CE low, that is between bursts. */
+    if (nrf24->plos_reset && !nrf24->rx_mode && nrf24->shadow_len[REG_RF_CH])
+    {
+        nrf24_engine_prep(nrf24, NRF24_OP_RF_CH, W_REGISTER | REG_RF_CH,
+                          nrf24->shadow[REG_RF_CH], 1);
+        return true;
+    }
+
+    if (kfifo_is_empty(&nrf24->tx_fifo))
+        nrf24->tx_waiting = false;
+    else if (nrf24_sched_tx_ready(nrf24))
+    {
+        /* Old TX_DS/MAX_RT are cleared and a stale TX FIFO dropped before the first payload. */
+        nrf24_set_ce(nrf24, 0);
+        nrf24->rx_mode     = false;
+        nrf24->tx_active   = true;
+        nrf24->tx_flush    = true;
+        nrf24->clear_flags |= STATUS_TX_DS | STATUS_MAX_RT;
+        nrf24->tx_since    = ktime_get();
+        nrf24->stats.tx_bursts++;
+
+        /* Without an IRQ line STATUS is polled while the burst runs. */
+        if (nrf24->irq <= 0)
+        {
+            nrf24->poll_period = nrf24->poll.interval_us;
+            nrf24->poll_hit = false;
+            hrtimer_start(&nrf24->poll_timer, us_to_ktime(nrf24->poll_period), HRTIMER_MODE_REL);
+        }
+
+        return nrf24_engine_config(nrf24, false) || nrf24_engine_next(nrf24);
+    }
+
+    if (nrf24->listening && !nrf24->rx_mode)
+    {
+        if (nrf24_engine_config(nrf24, true))
+            return true;
+
+        /* It takes 130us until RX mode is ready, nothing needs to wait for it. */
+        nrf24_set_ce(nrf24, 1);
+        nrf24->rx_mode = true;
+        nrf24->rx_since = ktime_get();
+    }
+
+    return false;
+}
+
+/* engine_lock held. STATUS clocked out by any step. A flag is acted on when it
+   first shows up, until it is cleared it is in clear_flags. */
+static void nrf24_engine_status(struct nrf24 *nrf24, u8 status)
+{
+    u8 flags = status & (STATUS_RX_DR | STATUS_TX_DS | STATUS_MAX_RT) & ~nrf24->clear_flags;
+
+    nrf24->status  = status;
+    nrf24->tx_full = status & STATUS_TX_FULL;
+    nrf24->rx_more = false;
+    nrf24->clear_flags |= flags;
+    if (flags)
+        nrf24->poll_hit = true;
+
+    /* Packets drained until the next RX_DR arrived with this one's IRQ. A burst
+       step may clock RX_DR out before the IRQ ran, irq_stamp is older then. */
+    if (flags & STATUS_RX_DR)
+    {
+        if (nrf24->irq > 0 && nrf24->irq_unstamped)
+            nrf24->rx_stamp = nrf24->irq_stamp;
+        else
+            nrf24->rx_stamp = ktime_get();
+        nrf24->irq_unstamped = 0;
+    }
+
+    /* RX_DR needs nothing here, RX_P_NO drives the drain. */
+    if (!nrf24->tx_active)
+        return;
+
+    if (flags & (STATUS_MAX_RT | STATUS_TX_DS))
+        nrf24->tx_observe = nrf24->esb.enable;
+
+    if (flags & STATUS_MAX_RT)
+    {
+        dev_warn_ratelimited(nrf24->miscdev.this_device,
+                             "No ACK after %u retransmits, TX FIFO dropped.\n",
+                             nrf24->esb.retr_count);
+        nrf24->stats.max_rt++;
+        nrf24->tx_flush = true;
+    }
+    else if (flags & STATUS_TX_DS)
+    {
+        nrf24_tx_timer_start(nrf24);
+
+        /* TX_DS may stand for several packets, the oldest one is sure to be gone. */
+        if (nrf24->tx_stamps)
+        {
+            nrf24_hist_add(nrf24->stats.tx_ds_hist, nrf24->tx_stamp[0]);
+            memmove(&nrf24->tx_stamp[0], &nrf24->tx_stamp[1],
+                    --nrf24->tx_stamps * sizeof(nrf24->tx_stamp[0]));
+        }
+
+        /* Nothing left to refill, find out if the last packet is gone. */
+        if (kfifo_is_empty(&nrf24->tx_fifo) || nrf24->quiesced || nrf24_sched_tx_over(nrf24))
+            nrf24->tx_check_fifo = true;
+    }
+}
+
+/* engine_lock held. Result of the step that just finished successfully. */
+static void nrf24_engine_done(struct nrf24 *nrf24)
+{
+    const u8 *rx = nrf24->rx_buf;
+    struct nrf24_packet pkt;
+    u8 flags, pipe;
+
+    nrf24->engine_errors = 0;
+    nrf24_engine_status(nrf24, rx[0]);
+
+    switch (nrf24->engine_op)
+    {
+    case NRF24_OP_STATUS:
+        break;
+    case NRF24_OP_CLEAR:
+        /* Flags raised since are in rx[0] and were kept for the next round,
+           the IRQ line only rises again once all of them are gone. */
+        nrf24->clear_flags &= ~nrf24->tx_buf[1];
+        nrf24->status &= ~nrf24->tx_buf[1];
+        break;
+    case NRF24_OP_CONFIG:
+        nrf24_shadow_update(nrf24, REG_CONFIG, &nrf24->tx_buf[1], 1);
+        break;
+    case NRF24_OP_RX_WIDTH:
+        /* Speculative read on an empty FIFO, the width means nothing. */
+        if ((rx[0] & STATUS_RX_P_NO) >> 1 >= NRF24_PIPES)
+            break;
+        /* Corrupt width, datasheet says the packet must be flushed. */
+        if (!rx[1] || rx[1] > NRF24_MAX_PAYLOAD)
+            nrf24->rx_flush = true;
+        else
+            nrf24->rx_len = rx[1];
+        break;
+    case NRF24_OP_FLUSH_RX:
+        nrf24->rx_flush = false;
+        nrf24->status |= STATUS_RX_P_NO;
+        break;
+    case NRF24_OP_RX_PAYLOAD:
+        /* STATUS went out before the read, so RX_P_NO is still the pipe of this packet. */
+        pipe = (rx[0] & STATUS_RX_P_NO) >> 1;
+        pkt.len = nrf24->engine_xfer.len - 1;
+        memcpy(pkt.data, &rx[1], pkt.len);
+        pkt.pipe = pipe;
+        pkt.flags = 0;
+        pkt.stamp = nrf24->rx_stamp;
+        nrf24->stats.rx_packets++;
+        if (nrf24->irq > 0)
+            nrf24_hist_add(nrf24->stats.irq_read_hist, nrf24->rx_stamp);
+
+        if (pipe < NRF24_PIPES && nrf24->bonded)
+            nrf24_bond_rx(&pkt);
+        else if (pipe < NRF24_PIPES && nrf24_ring_mapped(nrf24))
+            nrf24_ring_put(nrf24, pipe, &pkt);
+        else if (pipe < NRF24_PIPES && nrf24->fragment && !nrf24->netdev_up)
+            nrf24_msg_rx(nrf24, &nrf24->pipes[pipe], &pkt);
+        else if (pipe < NRF24_PIPES)
+        {
+            /* NAPI drains the queues in batches, readers are woken otherwise. */
+            if (nrf24->pipes[pipe].dropped)
+                pkt.flags |= NRF24_RX_DROPPED;
+            if (kfifo_in_spinlocked(&nrf24->pipes[pipe].rx_fifo, &pkt, 1, &nrf24->rx_lock))
+            {
+                nrf24->pipes[pipe].dropped = false;
+                if (nrf24->netdev_up)
+                    nrf24->napi_kick = true;
+                else
+                    wake_up_interruptible(&nrf24->rx_wq);
+            }
+            else
+            {
+                nrf24->pipes[pipe].dropped = true;
+                nrf24->stats.rx_dropped++;
+                dev_warn_ratelimited(nrf24->miscdev.this_device,
+                                     "RX queue of pipe %u full, packet dropped.\n", pipe);
+            }
+        }
+
+        /* Head moved on, the next STATUS says where. With dynamic payloads
+           the width read of the next packet brings it along. */
+        nrf24->rx_len = 0;
+        nrf24->status |= STATUS_RX_P_NO;
+        if (nrf24_dpl_enabled(nrf24))
+            nrf24->rx_more = true;
+        else
+            nrf24->status_stale = true;
+        break;
+    case NRF24_OP_TX_PAYLOAD:
+        nrf24->stats.tx_packets++;
+        if (nrf24->tx_stamps == NRF24_TX_FIFO_DEPTH)
+            memmove(&nrf24->tx_stamp[0], &nrf24->tx_stamp[1],
+                    --nrf24->tx_stamps * sizeof(nrf24->tx_stamp[0]));
+        nrf24->tx_stamp[nrf24->tx_stamps++] = ktime_get();
+
+        nrf24->tx_inflight = true;
+        nrf24_tx_timer_start(nrf24);
+        /* TX_FULL came out before this write. tx_stamps never counts less than
+           the FIFO holds, only if it may be full a NOP has to tell. */
+        if (nrf24->tx_stamps >= NRF24_TX_FIFO_DEPTH)
+            nrf24->status_stale = true;
+        break;
+    case NRF24_OP_FLUSH_TX:
+        nrf24->tx_flush    = false;
+        nrf24->tx_inflight = false;
+        nrf24->tx_full     = false;
+        nrf24->tx_stamps   = 0;
+        break;
+    case NRF24_OP_FIFO_STATUS:
+        nrf24->tx_full = rx[1] & FIFO_STATUS_TX_FULL;
+        if (rx[1] & FIFO_STATUS_TX_EMPTY)
+        {
+            nrf24->tx_inflight = false;
+            nrf24->tx_stamps = 0;
+        }
+        break;
+    case NRF24_OP_OBSERVE_TX:
+        /* ARC_CNT is for the last packet only, PLOS_CNT counts up until RF_CH is written. */
+        nrf24->stats.retransmits += rx[1] & OBSERVE_TX_ARC_CNT;
+        flags = (rx[1] & OBSERVE_TX_PLOS_CNT) >> 4;
+        if (flags > nrf24->plos_last)
+            nrf24->stats.lost += flags - nrf24->plos_last;
+        nrf24->plos_last = flags;
+        if (flags == OBSERVE_TX_PLOS_CNT >> 4)
+            nrf24->plos_reset = true;
+        break;
+    case NRF24_OP_RF_CH:
+        nrf24->plos_reset = false;
+        nrf24->plos_last = 0;
+        break;
+    }
+}
+
+/* engine_lock held. */
+static void nrf24_engine_error(struct nrf24 *nrf24, int err)
+{
+    dev_err_ratelimited(nrf24->miscdev.this_device, "SPI step %d failed: %d\n",
+                        nrf24->engine_op, err);
+
+    if (nrf24->engine_op == NRF24_OP_CONFIG)
+        nrf24->shadow_len[REG_CONFIG] = 0;
+
+    /* Nothing is known about the chip anymore, start over from STATUS. */
+    nrf24->status = STATUS_RX_P_NO;
+    nrf24->rx_len = 0;
+    nrf24->rx_flush = false;
+    nrf24->rx_more = false;
+    if (++nrf24->engine_errors < NRF24_ENGINE_MAX_ERRORS)
+    {
+        nrf24->status_stale = true;
+        return;
+    }
+
+    /* Bus is gone, stop until the next kick and don't leave writers blocked. */
+    nrf24->status_stale = false;
+    nrf24->clear_flags = 0;
+    spin_lock(&nrf24->tx_lock);
+    kfifo_reset(&nrf24->tx_fifo);
+    spin_unlock(&nrf24->tx_lock);
+    nrf24_net_tx_wake(nrf24);
+    nrf24_bond_tx_wake(nrf24);
+    if (nrf24->tx_active)
+        nrf24_tx_end(nrf24);
+
+    /* The IRQ line is edge triggered and stays low while flags are set,
+       nothing else would read STATUS again. */
+    hrtimer_start(&nrf24->retry_timer, ms_to_ktime(NRF24_ENGINE_RETRY_MS), HRTIMER_MODE_REL);
+}
+
+/* Submits the next step if the bus is free. Any context. */
+static void nrf24_engine_run(struct nrf24 *nrf24)
+{
+    unsigned long flags;
+    bool issue = false;
+    int ret;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    if (!nrf24->engine_busy)
+    {
+        issue = nrf24_engine_next(nrf24);
+        if (!issue)
+            wake_up_all(&nrf24->engine_wq);
+    }
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    if (!issue)
+        return;
+
+    /* engine_busy keeps everybody else off until the completion. */
+    ret = spi_async(nrf24->device, &nrf24->engine_msg);
+    if (ret)
+    {
+        nrf24->engine_msg.status = ret;
+        nrf24_engine_complete(nrf24);
+    }
+}
+
+/* The completion may run in the SPI pump thread, a softirq raised there with
+   bottom halves enabled would wait for the next interrupt. */
+static void nrf24_napi_kick(struct nrf24 *nrf24)
+{
+    if (in_hardirq() || irqs_disabled())
+    {
+        napi_schedule(&nrf24->napi);
+        return;
+    }
+
+    local_bh_disable();
+    napi_schedule(&nrf24->napi);
+    local_bh_enable();
+}
+
+static void nrf24_engine_complete(void *context)
+{
+    struct nrf24 *nrf24 = context;
+    unsigned long flags;
+    bool kick;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    nrf24->engine_busy = false;
+    if (nrf24->engine_msg.status)
+        nrf24_engine_error(nrf24, nrf24->engine_msg.status);
+    else
+        nrf24_engine_done(nrf24);
+    kick = nrf24->napi_kick;
+    nrf24->napi_kick = false;
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    if (kick)
+        nrf24_napi_kick(nrf24);
+
+    nrf24_engine_run(nrf24);
+}
+
+static bool nrf24_engine_idle(struct nrf24 *nrf24)
+{
+    unsigned long flags;
+    bool idle;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    idle = !nrf24->engine_busy && !nrf24->tx_active;
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    return idle;
+}
+
+static irqreturn_t nrf24_irq(int irq, void *dev_id)
+{
+    struct nrf24 *nrf24 = dev_id;
+    unsigned long flags;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    nrf24->irq_stamp = ktime_get();
+    /* RX_DR already seen and stamped, this IRQ is the late one of that packet. */
+    if (!(nrf24->clear_flags & STATUS_RX_DR))
+        nrf24->irq_unstamped++;
+    nrf24->status_stale = true;
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    nrf24_engine_run(nrf24);
+
+    return IRQ_HANDLED;
+}
+
+/* No TX_DS/MAX_RT in time, drop the TX FIFO and go on with the queue. */
+static enum hrtimer_restart nrf24_tx_timeout(struct hrtimer *timer)
+{
+    struct nrf24 *nrf24 = container_of(timer, struct nrf24, tx_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    if (nrf24->tx_active && nrf24->tx_inflight)
+    {
+        dev_err_ratelimited(nrf24->miscdev.this_device, "Transmittion failed: %d\n", -ETIMEDOUT);
+        nrf24->stats.tx_timeouts++;
+        nrf24->tx_flush = true;
+    }
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    nrf24_engine_run(nrf24);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Another try after the engine gave up, STATUS first so pending flags get cleared. */
+static enum hrtimer_restart nrf24_retry_timer(struct hrtimer *timer)
+{
+    struct nrf24 *nrf24 = container_of(timer, struct nrf24, retry_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    nrf24->engine_errors = 0;
+    nrf24->status_stale = true;
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    nrf24_engine_run(nrf24);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Polled radio, makes poll() take another look at STATUS. */
+static enum hrtimer_restart nrf24_rx_wake_timer(struct hrtimer *timer)
+{
+    struct nrf24 *nrf24 = container_of(timer, struct nrf24, rx_wake_timer);
+
+    wake_up_interruptible(&nrf24->rx_wq);
+
+    return HRTIMER_NORESTART;
+}
+
+/* End of a coalescing delay or listening window, a held burst may start. */
+static enum hrtimer_restart nrf24_sched_timer(struct hrtimer *timer)
+{
+    struct nrf24 *nrf24 = container_of(timer, struct nrf24, sched_timer);
+
+    nrf24_engine_run(nrf24);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Stands in for the IRQ line while a burst runs on boards without one. */
+static enum hrtimer_restart nrf24_poll_timer(struct hrtimer *timer)
+{
+    struct nrf24 *nrf24 = container_of(timer, struct nrf24, poll_timer);
+    unsigned long flags;
+    bool active;
+    u32 period = 0;
+
+    spin_lock_irqsave(&nrf24->engine_lock, flags);
+    active = nrf24->tx_active;
+    if (active)
+    {
+        nrf24->status_stale = true;
+        nrf24->stats.polls++;
+
+        /* The previous poll has finished by now, a quiet one backs off. */
+        if (nrf24->poll_hit)
+            nrf24->poll_period = nrf24->poll.interval_us;
+        else
+            nrf24->poll_period = min(nrf24->poll_period * 2, nrf24->poll.max_interval_us);
+        nrf24->poll_hit = false;
+        period = nrf24->poll_period;
+    }
+    spin_unlock_irqrestore(&nrf24->engine_lock, flags);
+
+    if (!active)
+        return HRTIMER_NORESTART;
+
+    nrf24_engine_run(nrf24);
+
+    hrtimer_forward_now(timer, us_to_ktime(period));
+    return HRTIMER_RESTART;
+}
+
+/* Takes the chip from the engine for sync SPI: lets the running burst finish,
+   then nothing is submitted until nrf24_unlock(). */
+static void nrf24_lock(struct nrf24 *nrf24)
+{
+    mutex_lock(&nrf24->lock);
+
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->quiesced = true;
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    nrf24_engine_run(nrf24);
+    wait_event(nrf24->engine_wq, nrf24_engine_idle(nrf24));
+}
+
+static void nrf24_unlock(struct nrf24 *nrf24)
+{
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->quiesced = false;
+    /* CE and CONFIG may have been changed, IRQs were left pending. */
+    nrf24->rx_mode = false;
+    nrf24->status_stale = true;
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    mutex_unlock(&nrf24->lock);
+
+    nrf24_engine_run(nrf24);
+}
+
+/* PRX with CE high from now on, also after every TX burst. */
+static void nrf24_start_listening(struct nrf24 *nrf24)
+{
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->listening = true;
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    nrf24_engine_run(nrf24);
+}
+
+/* Drops queued packets, the running burst ends with what is in the TX FIFO. */
+static void nrf24_tx_cancel(struct nrf24 *nrf24)
+{
+    spin_lock_irq(&nrf24->tx_lock);
+    kfifo_reset(&nrf24->tx_fifo);
+    spin_unlock_irq(&nrf24->tx_lock);
+
+    wake_up_interruptible(&nrf24->tx_wq);
+    nrf24_net_tx_wake(nrf24);
+    nrf24_bond_tx_wake(nrf24);
+}
+
+/* Queues behind what the caller has in the sequence and sends it all,
+   CONFIG last so the power up delay counts from there. */
+static int nrf24_init_defaults(struct nrf24 *nrf24)
+{
+    struct nrf24_esb_config *esb = &nrf24->esb;
+    bool powered;
+    int ret, i;
+    u8 tmp;
+
+    /* Auto ack in ESB mode, dynamic payload length requires it too */
+    tmp = (esb->enable || nrf24_dpl_enabled(nrf24)) ? ALL_PIPES : 0;
+    ret = nrf24_seq_write(nrf24, REG_EN_AA, &tmp, 1);
+    if (ret) return ret;
+
+    /* ARD in bits 7:4 as (n + 1) * 250us, ARC in bits 3:0 */
+    tmp = 0;
+    if (esb->enable)
+        tmp = (((esb->retr_delay_us / 250) - 1) << 4) | esb->retr_count;
+    ret = nrf24_seq_write(nrf24, REG_SETUP_RETR, &tmp, 1);
+    if (ret) return ret;
+
+    /* Address width = 5 bytes */
+    tmp = 0x03;
+    ret = nrf24_seq_write(nrf24, REG_SETUP_AW, &tmp, 1);
+    if (ret) return ret;
+
+    /* Fixed payload length = 32 on every pipe */
+    tmp = 32;
+    for (i = 0; i < NRF24_PIPES; i++)
+    {
+        ret = nrf24_seq_write(nrf24, REG_RX_PW_P0 + i, &tmp, 1);
+        if (ret) return ret;
+    }
+
+    tmp = nrf24->rf.channel;
+    ret = nrf24_seq_write(nrf24, REG_RF_CH, &tmp, 1);
+    if (ret) return ret;
+
+    /* RF_DR_LOW/RF_DR_HIGH: 00 1Mbps, 01 2Mbps, 10 250kbps. RF_PWR: -18dBm + 6dBm steps */
+    tmp = RF_SETUP_LNA_HCURR | ((((nrf24->rf.pa_dbm + 18) / 6) << 1) & RF_SETUP_RF_PWR);
+    if (nrf24->rf.data_rate_kbps == 250)
+        tmp |= RF_SETUP_RF_DR_LOW;
+    else if (nrf24->rf.data_rate_kbps == 2000)
+        tmp |= RF_SETUP_RF_DR_HIGH;
+    ret = nrf24_seq_write(nrf24, REG_RF_SETUP, &tmp, 1);
+    if (ret) return ret;
+
+    /* Dynamic payload length on all pipes, ACK payloads need it on both ends */
+    tmp = 0;
+    if (nrf24_dpl_enabled(nrf24))
+        tmp |= FEATURE_EN_DPL;
+    if (esb->ack_payload)
+        tmp |= FEATURE_EN_ACK_PAY;
+    if (nrf24->dynpd && !esb->enable)
+        tmp |= FEATURE_EN_DYN_ACK;
+    ret = nrf24_seq_write(nrf24, REG_FEATURE, &tmp, 1);
+    if (ret) return ret;
+    tmp = nrf24_dpl_enabled(nrf24) ? ALL_PIPES : 0;
+    ret = nrf24_seq_write(nrf24, REG_DYNPD, &tmp, 1);
+    if (ret) return ret;
+
+    /* Chip keeps its registers while powered down, the shadow tells if it is up already. */
+    powered = nrf24->shadow_len[REG_CONFIG] && (nrf24->shadow[REG_CONFIG][0] & CONFIG_PWR_UP);
+
+    /* CONFIG: PWR_UP, CRC as configured (off by default) */
+    tmp = 0;
+    tmp |= CONFIG_PWR_UP;
+    if (esb->crc_bytes)
+        tmp |= CONFIG_EN_CRC;
+    if (esb->crc_bytes == 2)
+        tmp |= CONFIG_CRCO;
+    ret = nrf24_seq_write(nrf24, REG_CONFIG, &tmp, 1);
+    if (!ret)
+        ret = nrf24_seq_submit(nrf24);
+    if (ret) return ret;
+
+    if (!powered)
+        msleep(2); /* From power down to standby-1 mode, 1.5ms is required. */
+
+    return ret;
+}
+
+/* Pipe that listens on config.rx_address. In ESB mode PTX receives ACKs on P0,
+   so P0 carries the TX address and the RX address moves to P1. */
+static u8 nrf24_primary_pipe(struct nrf24 *nrf24)
+{
+    return nrf24->esb.enable ? 1 : 0;
+}
+
+/* Queues the addresses into the register sequence. */
+static int nrf24_write_addresses(struct nrf24 *nrf24)
+{
+    struct nrf24_pipe *pipe;
+    u8 primary = nrf24_primary_pipe(nrf24);
+    u8 en_rxaddr = 0;
+    int ret, i;
+
+    memcpy(nrf24->pipes[primary].address, nrf24->config.rx_address, 5);
+    nrf24->pipes[primary].enabled = true;
+
+    for (i = 0; i < NRF24_PIPES; i++)
+    {
+        pipe = &nrf24->pipes[i];
+
+        if (i == 0 && nrf24->esb.enable)
+        {
+            ret = nrf24_seq_write(nrf24, REG_RX_ADDR_P0, nrf24->config.tx_address, 5);
+            if (ret) return ret;
+            en_rxaddr |= 1 << i;
+            continue;
+        }
+
+        if (!pipe->enabled)
+            continue;
+
+        /* Only P0 and P1 have full 5 byte addresses. */
+        ret = nrf24_seq_write(nrf24, REG_RX_ADDR_P0 + i, pipe->address, i < 2 ? 5 : 1);
+        if (ret) return ret;
+        en_rxaddr |= 1 << i;
+    }
+
+    ret = nrf24_seq_write(nrf24, REG_EN_RXADDR, &en_rxaddr, 1);
+    if (ret) return ret;
+
+    return nrf24_seq_write(nrf24, REG_TX_ADDR, nrf24->config.tx_address, 5);
+}
+
+/* Writes the whole configuration to the chip and resumes listening if it was on. */
+static int nrf24_reconfigure(struct nrf24 *nrf24)
+{
+    int ret;
+
+    nrf24_tx_cancel(nrf24);
+
+    nrf24_lock(nrf24);
+    nrf24_set_ce(nrf24, 0);
+
+    /* One bus submission for everything that changed. */
+    nrf24_seq_init(nrf24);
+    ret = nrf24_write_addresses(nrf24);
+    if (!ret)
+        ret = nrf24_init_defaults(nrf24);
+
+    /* With an IRQ line packets are collected from now on, not only during read().
+       The engine switches to PRX once the chip is handed back. */
+    if (!ret && nrf24->irq > 0)
+        nrf24->listening = true;
+    nrf24_unlock(nrf24);
+
+    return ret;
+}
+
+/* After INIT_NRF24 release() may have powered the radio down, the registers
+   survive that and reconfigure only has to write CONFIG again. */
+static int nrf24_power_up(struct nrf24 *nrf24)
+{
+    bool powered;
+
+    mutex_lock(&nrf24->lock);
+    powered = nrf24->shadow_len[REG_CONFIG] && (nrf24->shadow[REG_CONFIG][0] & CONFIG_PWR_UP);
+    mutex_unlock(&nrf24->lock);
+
+    return powered ? 0 : nrf24_reconfigure(nrf24);
+}
+
+static int nrf24_check_esb(const struct nrf24_esb_config *esb)
+{
+    if (esb->crc_bytes > 2 || esb->retr_count > 15)
+        return -EINVAL;
+
+    /* ACK payloads ride on auto acknowledgement. */
+    if (esb->ack_payload && !esb->enable)
+        return -EINVAL;
+
+    if (esb->enable &&
+        (esb->retr_delay_us < 250 || esb->retr_delay_us > 4000 || esb->retr_delay_us % 250))
+        return -EINVAL;
+
+    return 0;
+}
+
+static int nrf24_check_rf(const struct nrf24_rf_config *rf)
+{
+    if (!rf->spi_hz || rf->spi_hz > NRF24_SPI_MAX_HZ || rf->channel > NRF24_MAX_CHANNEL)
+        return -EINVAL;
+
+    if (rf->data_rate_kbps != 250 && rf->data_rate_kbps != 1000 && rf->data_rate_kbps != 2000)
+        return -EINVAL;
+
+    if (rf->pa_dbm != -18 && rf->pa_dbm != -12 && rf->pa_dbm != -6 && rf->pa_dbm != 0)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int nrf24_check_poll(const struct nrf24_poll_config *pc)
+{
+    if (pc->interval_us < NRF24_POLL_MIN_US || pc->interval_us > NRF24_POLL_LIMIT_US ||
+        pc->max_interval_us < pc->interval_us || pc->max_interval_us > NRF24_POLL_LIMIT_US)
+        return -EINVAL;
+
+    if (pc->rx_timeout_us < pc->interval_us || pc->rx_timeout_us > NRF24_SCHED_MAX_US ||
+        pc->busy_us > NRF24_POLL_BUSY_LIMIT_US)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int nrf24_check_sched(const struct nrf24_sched_config *sc)
+{
+    if (sc->coalesce_us > NRF24_SCHED_MAX_US)
+        return -EINVAL;
+
+    if (sc->policy == NRF24_SCHED_TX_PRIORITY)
+        return 0;
+
+    /* A slot shorter than the settling time would never carry anything. */
+    if (sc->policy != NRF24_SCHED_SLOTS ||
+        sc->rx_slot_us < NRF24_SETTLE_US || sc->rx_slot_us > NRF24_SCHED_MAX_US ||
+        sc->tx_slot_us < NRF24_SETTLE_US || sc->tx_slot_us > NRF24_SCHED_MAX_US)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int nrf24_open(struct inode *inode, struct file *file)
+{
+    struct miscdevice *misc = file->private_data;
+    struct nrf24 *nrf24 = container_of(misc, struct nrf24, miscdev);
+    int ret = 0; 
+    // Set nrf24 struct as private data, it is needed in write/read to have spi_device.
+    file->private_data = nrf24;
+
+    /* read_iter/write_iter honour IOCB_NOWAIT, io_uring may issue inline. A polled
+       radio never raises EPOLLIN by itself, io_uring has to block in io-wq there. */
+    if (nrf24->irq > 0)
+        file->f_mode |= FMODE_NOWAIT;
+
+    /* Running network interface or open bond keeps the radio as it is. */
+    if (READ_ONCE(nrf24->netdev_up) || READ_ONCE(nrf24->bonded))
+        return 0;
+
+    /* Warm standby, the last session left the radio configured and powered. */
+    if (nrf24->standby)
+        return 0;
+
+    /* Power down, it will be power up in init. */
+    u8 tmp = 0;
+    nrf24_lock(nrf24);
+    ret = nrf24_write_regs(nrf24, REG_CONFIG, &tmp, 1);
+    nrf24_unlock(nrf24);
+    if (ret) return ret;
+    return ret;
+}
+
+static int nrf24_release(struct inode *inode, struct file *file)
+{
+    struct nrf24 *nrf24 = file->private_data;
+    unsigned long timeout;
+    u8 tmp = 0;
+    int ret = 0;
+
+    /* Running network interface or open bond keeps the radio as it is. */
+    if (READ_ONCE(nrf24->netdev_up) || READ_ONCE(nrf24->bonded))
+        return 0;
+
+    /* Let queued packets go out before powering down, each may hit the TX timeout. */
+    timeout = msecs_to_jiffies(NRF24_TX_QUEUE_LEN * (NRF24_TX_TIMEOUT_MS + nrf24_retransmit_ms(nrf24)));
+    if (!wait_event_timeout(nrf24->engine_wq,
+                            kfifo_is_empty(&nrf24->tx_fifo) && nrf24_engine_idle(nrf24),
+                            timeout))
+        nrf24_tx_cancel(nrf24);
+
+    nrf24_lock(nrf24);
+
+    /* CE 0 */
+    nrf24_set_ce(nrf24, 0);
+    nrf24->listening = false;
+
+    /* Power down, unless the next session should find it in Standby-I. */
+    if (!nrf24->standby)
+        ret = nrf24_write_regs(nrf24, REG_CONFIG, &tmp, 1);
+    nrf24_unlock(nrf24);
+    if (ret) return ret;
+    return 0;
+}
+
+static long nrf24_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct nrf24 *nrf24 = file->private_data;
+    int ret = 0;
+
+    switch (cmd)
+    {
+    case INIT_NRF24:
+    {
+        struct nrf24_config config;
+        struct gpio_desc *ce_gpio;
+        bool warm;
+
+        if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+            return -EFAULT; // Bad address.
+
+        // If it is 0 which means module is transmitter and needs CE.
+        ce_gpio = gpio_to_desc(config.ce_gpio);
+        if (!ce_gpio)
+        {
+            dev_err(nrf24->miscdev.this_device, "Error getting gpio descripter : %llu", config.ce_gpio);
+            return -EINVAL; // Invalid argument.
+        }
+
+        /* CE is driven from the IRQ and SPI completion path. */
+        if (gpiod_cansleep(ce_gpio))
+        {
+            dev_err(nrf24->miscdev.this_device, "CE gpio %llu can sleep, not supported\n", config.ce_gpio);
+            return -EINVAL;
+        }
+
+        /* Same setup on a radio left in warm standby, the shadow is still
+           right and reconfigure finds nothing to write. */
+        warm = nrf24->standby && nrf24->initialized &&
+               !memcmp(&nrf24->config, &config, sizeof(config));
+
+        /* The engine toggles CE, swap the pin only while it is quiet. */
+        nrf24_lock(nrf24);
+        if (nrf24->ce_gpio && nrf24->ce_gpio != ce_gpio)
+            nrf24_set_ce(nrf24, 0);
+        ret = gpiod_direction_output(ce_gpio, 0); // Default low.
+        if (ret)
+        {
+            nrf24_unlock(nrf24);
+            dev_err(nrf24->miscdev.this_device, "Error setting pin %llu as output\n", config.ce_gpio);
+            return ret;
+        }
+        nrf24->ce_gpio = ce_gpio;
+        WRITE_ONCE(nrf24->ce, 0);
+        nrf24->config = config;
+
+        nrf24->listening = false;
+        nrf24_rx_reset(nrf24);
+        /* Radio may have been replugged, write every register once. */
+        if (!warm)
+            nrf24_shadow_invalidate(nrf24);
+        nrf24_unlock(nrf24);
+
+        ret = nrf24_reconfigure(nrf24);
+        nrf24->initialized = !ret;
+        return ret;
+    }
+    case NRF24_SET_ESB:
+    {
+        struct nrf24_esb_config esb;
+
+        if (copy_from_user(&esb, (void __user *)arg, sizeof(esb)))
+            return -EFAULT;
+
+        ret = nrf24_check_esb(&esb);
+        if (ret)
+            return ret;
+
+        nrf24->esb = esb;
+
+        /* Before INIT_NRF24 it is only stored, INIT applies it. */
+        if (nrf24->initialized)
+            ret = nrf24_reconfigure(nrf24);
+        return ret;
+    }
+    case NRF24_SET_DYNPD:
+    {
+        int enable;
+
+        if (copy_from_user(&enable, (void __user *)arg, sizeof(enable)))
+            return -EFAULT;
+
+        nrf24->dynpd = !!enable;
+
+        /* Before INIT_NRF24 it is only stored, INIT applies it. */
+        if (nrf24->initialized)
+            ret = nrf24_reconfigure(nrf24);
+        return ret;
+    }
+    case NRF24_SET_STANDBY:
+    {
+        int enable;
+
+        if (copy_from_user(&enable, (void __user *)arg, sizeof(enable)))
+            return -EFAULT;
+
+        /* Takes effect on the next release(). */
+        nrf24->standby = !!enable;
+        return 0;
+    }
+    case NRF24_SET_RF:
+    {
+        struct nrf24_rf_config rf;
+        u32 speed_hz;
+
+        if (copy_from_user(&rf, (void __user *)arg, sizeof(rf)))
+            return -EFAULT;
+
+        ret = nrf24_check_rf(&rf);
+        if (ret)
+            return ret;
+
+        /* SPI clock applies right away, no transfer may be in flight. A
+           rejected clock leaves device and rf as they were. */
+        nrf24_lock(nrf24);
+        speed_hz = nrf24->device->max_speed_hz;
+        nrf24->device->max_speed_hz = rf.spi_hz;
+        ret = spi_setup(nrf24->device);
+        if (ret)
+        {
+            nrf24->device->max_speed_hz = speed_hz;
+            spi_setup(nrf24->device);
+        }
+        else
+            nrf24->rf = rf;
+        nrf24_unlock(nrf24);
+        if (ret)
+            return ret;
+
+        /* Before INIT_NRF24 it is only stored, INIT applies it. */
+        if (nrf24->initialized)
+            ret = nrf24_reconfigure(nrf24);
+        return ret;
+    }
+    case NRF24_SET_FRAGMENT:
+    {
+        int enable;
+        int i;
+
+        if (copy_from_user(&enable, (void __user *)arg, sizeof(enable)))
+            return -EFAULT;
+
+        /* Reassembly runs in the IRQ driven RX path. */
+        if (nrf24->irq <= 0)
+            return -EOPNOTSUPP;
+
+        /* Nothing on air changes, only how payloads are framed. */
+        spin_lock_irq(&nrf24->engine_lock);
+        nrf24->fragment = !!enable;
+        for (i = 0; i < NRF24_PIPES; i++)
+            nrf24->pipes[i].reasm.count = 0;
+        spin_unlock_irq(&nrf24->engine_lock);
+        return 0;
+    }
+    case NRF24_SET_READ_FORMAT:
+    {
+        int format;
+
+        if (copy_from_user(&format, (void __user *)arg, sizeof(format)))
+            return -EFAULT;
+
+        if (format != NRF24_READ_RAW && format != NRF24_READ_META)
+            return -EINVAL;
+
+        /* Timestamps are taken at the interrupt. */
+        if (format == NRF24_READ_META && nrf24->irq <= 0)
+            return -EOPNOTSUPP;
+
+        WRITE_ONCE(nrf24->read_meta, format == NRF24_READ_META);
+        return 0;
+    }
+    case NRF24_SET_SCHED:
+    {
+        struct nrf24_sched_config sc;
+
+        if (copy_from_user(&sc, (void __user *)arg, sizeof(sc)))
+            return -EFAULT;
+
+        ret = nrf24_check_sched(&sc);
+        if (ret)
+            return ret;
+
+        /* Takes effect with the next decision of the engine, a held burst is reconsidered. */
+        spin_lock_irq(&nrf24->engine_lock);
+        nrf24->sched = sc;
+        spin_unlock_irq(&nrf24->engine_lock);
+        hrtimer_cancel(&nrf24->sched_timer);
+        nrf24_engine_run(nrf24);
+        return 0;
+    }
+    case NRF24_SET_POLL:
+    {
+        struct nrf24_poll_config pc;
+
+        if (copy_from_user(&pc, (void __user *)arg, sizeof(pc)))
+            return -EFAULT;
+
+        /* With the IRQ line nothing is polled. */
+        if (nrf24->irq > 0)
+            return -EOPNOTSUPP;
+
+        ret = nrf24_check_poll(&pc);
+        if (ret)
+            return ret;
+
+        /* read() uses it under the mutex, the poll timer under engine_lock. */
+        mutex_lock(&nrf24->lock);
+        spin_lock_irq(&nrf24->engine_lock);
+        nrf24->poll = pc;
+        spin_unlock_irq(&nrf24->engine_lock);
+        mutex_unlock(&nrf24->lock);
+        return 0;
+    }
+    case NRF24_SET_PIPE:
+    {
+        struct nrf24_pipe_config pc;
+        struct nrf24_pipe *pipe;
+
+        if (copy_from_user(&pc, (void __user *)arg, sizeof(pc)))
+            return -EFAULT;
+
+        if (pc.pipe >= NRF24_PIPES)
+            return -EINVAL;
+
+        /* P0 is needed for ACKs in ESB mode. */
+        if (pc.pipe == 0 && nrf24->esb.enable)
+            return -EBUSY;
+
+        /* The primary pipe listens on config.rx_address and stays on. */
+        if (!pc.enable && pc.pipe == nrf24_primary_pipe(nrf24))
+            return -EBUSY;
+
+        mutex_lock(&nrf24->lock);
+        pipe = &nrf24->pipes[pc.pipe];
+        pipe->enabled = !!pc.enable;
+        memcpy(pipe->address, pc.address, 5);
+        if (pc.pipe == nrf24_primary_pipe(nrf24))
+            memcpy(nrf24->config.rx_address, pc.address, 5);
+        mutex_unlock(&nrf24->lock);
+
+        /* Before INIT_NRF24 it is only stored, INIT applies it. */
+        if (nrf24->initialized)
+            ret = nrf24_reconfigure(nrf24);
+        return ret;
+    }
+    case NRF24_SET_ACK_PAYLOAD:
+    {
+        struct nrf24_ack_payload ack;
+
+        if (copy_from_user(&ack, (void __user *)arg, sizeof(ack)))
+            return -EFAULT;
+
+        if (!nrf24->esb.enable || !nrf24->esb.ack_payload)
+            return -EINVAL;
+        if (ack.pipe > 5 || !ack.len || ack.len > NRF24_MAX_PAYLOAD)
+            return -EINVAL;
+
+        /* Goes to the TX FIFO, sent with the ACK of the next packet on that pipe. */
+        nrf24_lock(nrf24);
+        ret = nrf24_command(nrf24, W_ACK_PAYLOAD | ack.pipe, ack.data, NULL, ack.len);
+        nrf24_unlock(nrf24);
+        return ret;
+    }
+    default:
+        return -1;
+    }
+
+    return ret;
+}
+
+/* One whole message per read(), it stays queued if buf is too small. */
+static ssize_t nrf24_read_message(struct nrf24 *nrf, u8 pipes, struct file *file,
+                                  char __user *ubuf, size_t count)
+{
+    struct nrf24_pipe *pipe;
+    unsigned int copied;
+    int ret, i;
+
+    for (;;)
+    {
+        mutex_lock(&nrf->msg_lock);
+        for (i = 0; i < NRF24_PIPES; i++)
+        {
+            pipe = &nrf->pipes[i];
+            if (!(pipes & (1 << i)) || kfifo_is_empty(&pipe->msg_fifo))
+                continue;
+
+            if (count < kfifo_peek_len(&pipe->msg_fifo))
+                ret = -EMSGSIZE;
+            else
+                ret = kfifo_to_user(&pipe->msg_fifo, ubuf, count, &copied);
+            mutex_unlock(&nrf->msg_lock);
+            return ret ? ret : copied;
+        }
+        mutex_unlock(&nrf->msg_lock);
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(nrf->rx_wq, nrf24_rx_pending(nrf, pipes));
+        if (ret)
+            return ret;
+    }
+}
+
+/* Records of struct nrf24_rx_meta and payload, starting with pkt, as many as fit whole. */
+static ssize_t nrf24_read_meta(struct nrf24 *nrf, u8 pipes, struct nrf24_packet *pkt,
+                               char __user *ubuf, size_t count)
+{
+    struct nrf24_rx_meta meta;
+    size_t copied = 0;
+
+    memset(&meta, 0, sizeof(meta));
+    for (;;)
+    {
+        meta.timestamp_ns = ktime_to_ns(pkt->stamp);
+        meta.pipe = pkt->pipe;
+        meta.len = pkt->len;
+        meta.flags = pkt->flags;
+        if (copy_to_user(ubuf + copied, &meta, sizeof(meta)) ||
+            copy_to_user(ubuf + copied + sizeof(meta), pkt->data, pkt->len))
+            return copied ? copied : -EFAULT;
+        copied += sizeof(meta) + pkt->len;
+
+        if (count - copied < sizeof(meta) + NRF24_MAX_PAYLOAD)
+            break;
+        if (!nrf24_rx_get(nrf, pipes, pkt))
+            break;
+    }
+
+    return copied;
+}
+
+/* Queue based read for the pipes in the mask, used by main and pipe nodes. */
+static ssize_t nrf24_read_pipes(struct nrf24 *nrf, u8 pipes, struct file *file,
+                                char __user *ubuf, size_t count)
+{
+    struct nrf24_packet pkt;
+    size_t copied = 0;
+    size_t len;
+    int ret;
+
+    if (!READ_ONCE(nrf->listening))
+        nrf24_start_listening(nrf);
+
+    if (nrf->fragment)
+        return nrf24_read_message(nrf, pipes, file, ubuf, count);
+
+    /* A record of the longest payload must fit, nothing is left behind half read. */
+    if (READ_ONCE(nrf->read_meta) && count < sizeof(struct nrf24_rx_meta) + NRF24_MAX_PAYLOAD)
+        return -EMSGSIZE;
+
+    /* Block only for the first packet. */
+    while (!nrf24_rx_get(nrf, pipes, &pkt))
+    {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(nrf->rx_wq, nrf24_rx_pending(nrf, pipes));
+        if (ret)
+            return ret;
+    }
+
+    if (READ_ONCE(nrf->read_meta))
+        return nrf24_read_meta(nrf, pipes, &pkt, ubuf, count);
+
+    /* Then hand out every queued packet that fits completely in the buffer,
+       with dynamic payload length one packet per read() keeps its length. */
+    for (;;)
+    {
+        len = min_t(size_t, count - copied, pkt.len);
+        if (copy_to_user(ubuf + copied, pkt.data, len))
+            return copied ? copied : -EFAULT;
+        copied += len;
+
+        /* Packet boundaries would be lost with dynamic lengths. */
+        if (nrf24_dpl_enabled(nrf) || count - copied < NRF24_MAX_PAYLOAD)
+            break;
+        if (!nrf24_rx_get(nrf, pipes, &pkt))
+            break;
+    }
+
+    return copied;
+}
+
+static ssize_t nrf24_read(struct file *file,
+                          char __user *ubuf,
+                          size_t count,
+                          loff_t *ppos)
+{
+    struct nrf24 *nrf = file->private_data;
+    u8 buf[NRF24_MAX_PAYLOAD];
+    size_t len;
+    int ret;
+
+    /* No IRQ line, poll the chip for a single packet. */
+    if (nrf->irq <= 0)
+    {
+        /* Limit to max payload */
+        if (count > NRF24_MAX_PAYLOAD)
+            return -EINVAL;
+        len = count;
+
+        /* O_NONBLOCK looks once instead of polling until rx_timeout_us. */
+        nrf24_lock(nrf);
+        if (file->f_flags & O_NONBLOCK)
+            ret = nrf24_receive_nowait(nrf, buf, len);
+        else
+            ret = nrf24_receive(nrf, buf, len);
+        nrf24_unlock(nrf);
+        if (ret)
+            return ret;
+
+        if (copy_to_user(ubuf, buf, len))
+            return -EFAULT;
+
+        return len;
+    }
+
+    return nrf24_read_pipes(nrf, ALL_PIPES, file, ubuf, count);
+}
+
+/* IOCB_NOWAIT comes from io_uring and preadv2(RWF_NOWAIT), O_NONBLOCK from the file. */
+static bool nrf24_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/* Next whole message of the pipes in the mask into msg, 0 if there is none. */
+static int nrf24_msg_get(struct nrf24 *nrf, u8 pipes, u8 *msg, size_t max)
+{
+    struct nrf24_pipe *pipe;
+    int ret = 0;
+    int i;
+
+    mutex_lock(&nrf->msg_lock);
+    for (i = 0; i < NRF24_PIPES; i++)
+    {
+        pipe = &nrf->pipes[i];
+        if (!(pipes & (1 << i)) || kfifo_is_empty(&pipe->msg_fifo))
+            continue;
+
+        /* It stays queued for a bigger segment. */
+        if (max < kfifo_peek_len(&pipe->msg_fifo))
+            ret = -EMSGSIZE;
+        else
+            ret = kfifo_out(&pipe->msg_fifo, msg, max);
+        break;
+    }
+    mutex_unlock(&nrf->msg_lock);
+
+    return ret;
+}
+
+/* readv()/io_uring: one packet, meta record or message per segment. Blocks
+   only for the first one, never with IOCB_NOWAIT, EPOLLIN tells when to retry. */
+static ssize_t nrf24_read_iter_pipes(struct nrf24 *nrf, u8 pipes, struct kiocb *iocb,
+                                     struct iov_iter *to)
+{
+    struct nrf24_packet pkt;
+    struct nrf24_rx_meta meta;
+    bool meta_fmt = READ_ONCE(nrf->read_meta);
+    size_t copied = 0;
+    size_t seg, len;
+    u8 *msg = NULL;
+    int ret = 0;
+
+    if (!READ_ONCE(nrf->listening))
+        nrf24_start_listening(nrf);
+
+    if (READ_ONCE(nrf->fragment))
+    {
+        msg = kmalloc(NRF24_FRAG_MAX_MSG, GFP_KERNEL);
+        if (!msg)
+            return -ENOMEM;
+    }
+
+    memset(&meta, 0, sizeof(meta));
+    while (iov_iter_count(to))
+    {
+        seg = iov_iter_single_seg_count(to);
+        if (!seg)
+        {
+            iov_iter_advance(to, 0);
+            continue;
+        }
+
+        if (meta_fmt && !msg && seg < sizeof(meta) + NRF24_MAX_PAYLOAD)
+        {
+            ret = -EMSGSIZE;
+            break;
+        }
+
+        if (msg)
+            ret = nrf24_msg_get(nrf, pipes, msg, seg);
+        else
+            ret = nrf24_rx_get(nrf, pipes, &pkt);
+        if (ret < 0)
+            break;
+
+        if (!ret)
+        {
+            if (copied)
+                break;
+            if (nrf24_nowait(iocb))
+            {
+                ret = -EAGAIN;
+                break;
+            }
+            ret = wait_event_interruptible(nrf->rx_wq, nrf24_rx_pending(nrf, pipes));
+            if (ret)
+                break;
+            continue;
+        }
+
+        /* A packet taken off the queue is handed out even if the copy faults. */
+        if (msg)
+            len = copy_to_iter(msg, ret, to);
+        else if (meta_fmt)
+        {
+            meta.timestamp_ns = ktime_to_ns(pkt.stamp);
+            meta.pipe = pkt.pipe;
+            meta.len = pkt.len;
+            meta.flags = pkt.flags;
+            len = copy_to_iter(&meta, sizeof(meta), to);
+            len += copy_to_iter(pkt.data, pkt.len, to);
+        }
+        else
+            len = copy_to_iter(pkt.data, min_t(size_t, seg, pkt.len), to);
+        ret = 0;
+        if (!len)
+        {
+            ret = -EFAULT;
+            break;
+        }
+        copied += len;
+
+        /* The rest of the segment stays unused, the next packet takes the next one. */
+        iov_iter_advance(to, seg - len);
+    }
+
+    kfree(msg);
+    return copied ? copied : ret;
+}
+
+static ssize_t nrf24_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct nrf24 *nrf = iocb->ki_filp->private_data;
+    u8 buf[NRF24_MAX_PAYLOAD];
+    size_t len;
+    int ret;
+
+    if (nrf->irq > 0)
+        return nrf24_read_iter_pipes(nrf, ALL_PIPES, iocb, to);
+
+    /* Polled radio, a single packet of the first segment's size like read().
+       IOCB_NOWAIT may not even sleep on the SPI bus. */
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+
+    len = iov_iter_single_seg_count(to);
+    if (!len || len > NRF24_MAX_PAYLOAD)
+        return -EINVAL;
+
+    nrf24_lock(nrf);
+    if (nrf24_nowait(iocb))
+        ret = nrf24_receive_nowait(nrf, buf, len);
+    else
+        ret = nrf24_receive(nrf, buf, len);
+    nrf24_unlock(nrf);
+    if (ret)
+        return ret;
+
+    return copy_to_iter(buf, len, to) ? len : -EFAULT;
+}
+
+/* All or nothing, fragments of two writers must not interleave. */
+static int nrf24_frag_queue(struct nrf24 *nrf, struct nrf24_packet *pkts, unsigned int nfrags,
+                            bool nowait)
+{
+    unsigned int i;
+    int ret;
+
+    for (;;)
+    {
+        spin_lock_irq(&nrf->tx_lock);
+        if (kfifo_avail(&nrf->tx_fifo) >= nfrags)
+            break;
+        spin_unlock_irq(&nrf->tx_lock);
+
+        if (nowait)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(nrf->tx_wq, kfifo_avail(&nrf->tx_fifo) >= nfrags);
+        if (ret)
+            return ret;
+    }
+
+    for (i = 0; i < nfrags; i++)
+        ((struct nrf24_frag_hdr *)pkts[i].data)->id = nrf->tx_msg_id;
+    nrf->tx_msg_id++;
+    kfifo_in(&nrf->tx_fifo, pkts, nfrags);
+    spin_unlock_irq(&nrf->tx_lock);
+
+    nrf24_engine_run(nrf);
+    return 0;
+}
+
+/* Whole write() is one message, its fragments go to the queue back to back. */
+static ssize_t nrf24_write_message(struct nrf24 *nrf, struct file *file,
+                                   const char __user *ubuf, size_t count)
+{
+    struct nrf24_packet *pkts;
+    unsigned int nfrags, i;
+    size_t len;
+    int ret = 0;
+
+    if (!count || count > NRF24_FRAG_MAX_MSG)
+        return -EMSGSIZE;
+
+    nfrags = DIV_ROUND_UP(count, NRF24_FRAG_DATA);
+    pkts = kmalloc_array(nfrags, sizeof(*pkts), GFP_KERNEL);
+    if (!pkts)
+        return -ENOMEM;
+
+    for (i = 0; i < nfrags; i++)
+    {
+        len = min_t(size_t, count - i * NRF24_FRAG_DATA, NRF24_FRAG_DATA);
+        if (copy_from_user(pkts[i].data + NRF24_FRAG_HDR, ubuf + i * NRF24_FRAG_DATA, len))
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+        nrf24_frag_fill(nrf, &pkts[i], i, nfrags, len);
+    }
+
+    ret = nrf24_frag_queue(nrf, pkts, nfrags, file->f_flags & O_NONBLOCK);
+
+out:
+    kfree(pkts);
+    return ret ? ret : count;
+}
+
+static ssize_t nrf24_write(struct file *file,
+                           const char __user *ubuf,
+                           size_t count,
+                           loff_t *ppos)
+{
+    struct nrf24 *nrf = file->private_data;
+    struct nrf24_packet pkt;
+    bool dpl = nrf24_dpl_enabled(nrf);
+    size_t queued = 0;
+    size_t len;
+    int ret;
+
+    /* The bond numbers every packet, nothing may slip in between. */
+    if (READ_ONCE(nrf->bonded))
+        return -EBUSY;
+
+    if (nrf->fragment)
+        return nrf24_write_message(nrf, file, ubuf, count);
+
+    /* A single short packet, or any number of full payloads back to back.
+       With dynamic payload length the last packet may be short. */
+    if (!dpl && count > NRF24_MAX_PAYLOAD && count % NRF24_MAX_PAYLOAD)
+        return -EINVAL;
+
+    while (queued < count)
+    {
+        len = min_t(size_t, count - queued, NRF24_MAX_PAYLOAD);
+        if (copy_from_user(pkt.data, ubuf + queued, len))
+            return queued ? queued : -EFAULT;
+
+        /* Fixed width receivers expect the full payload, pad it. */
+        pkt.len = len;
+        if (!dpl)
+        {
+            memset(pkt.data + len, 0, NRF24_MAX_PAYLOAD - len);
+            pkt.len = NRF24_MAX_PAYLOAD;
+        }
+
+        /* Only queue it, the engine streams the queue to the radio. */
+        while (!kfifo_in_spinlocked(&nrf->tx_fifo, &pkt, 1, &nrf->tx_lock))
+        {
+            if (file->f_flags & O_NONBLOCK)
+                return queued ? queued : -EAGAIN;
+
+            ret = wait_event_interruptible(nrf->tx_wq, !kfifo_is_full(&nrf->tx_fifo));
+            if (ret)
+                return queued ? queued : ret;
+        }
+
+        /* Kick per packet, the burst starts while the rest is still being copied. */
+        nrf24_engine_run(nrf);
+        queued += len;
+    }
+
+    return queued;  /* Number of bytes queued */
+}
+
+/* writev()/io_uring: every segment is one packet, or one message with
+   fragmentation on. Never blocks with IOCB_NOWAIT, EPOLLOUT tells when to retry. */
+static ssize_t nrf24_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct nrf24 *nrf = iocb->ki_filp->private_data;
+    struct nrf24_packet *pkts;
+    bool dpl = nrf24_dpl_enabled(nrf);
+    /* NRF24_SET_FRAGMENT may flip it meanwhile, pkts is sized for this value. */
+    bool fragment = READ_ONCE(nrf->fragment);
+    size_t queued = 0;
+    unsigned int nfrags, i;
+    size_t seg, len;
+    int ret = 0;
+
+    if (READ_ONCE(nrf->bonded))
+        return -EBUSY;
+
+    pkts = kmalloc_array(fragment ? NRF24_NET_MAX_FRAGS : 1, sizeof(*pkts), GFP_KERNEL);
+    if (!pkts)
+        return -ENOMEM;
+
+    while (iov_iter_count(from))
+    {
+        seg = iov_iter_single_seg_count(from);
+        if (!seg)
+        {
+            iov_iter_advance(from, 0);
+            continue;
+        }
+
+        if (seg > (fragment ? NRF24_FRAG_MAX_MSG : NRF24_MAX_PAYLOAD))
+        {
+            ret = fragment ? -EMSGSIZE : -EINVAL;
+            break;
+        }
+
+        if (fragment)
+        {
+            nfrags = DIV_ROUND_UP(seg, NRF24_FRAG_DATA);
+            for (i = 0; i < nfrags; i++)
+            {
+                len = min_t(size_t, seg - i * NRF24_FRAG_DATA, NRF24_FRAG_DATA);
+                if (!copy_from_iter_full(pkts[i].data + NRF24_FRAG_HDR, len, from))
+                {
+                    ret = -EFAULT;
+                    break;
+                }
+                nrf24_frag_fill(nrf, &pkts[i], i, nfrags, len);
+            }
+        }
+        else
+        {
+            nfrags = 1;
+            if (!copy_from_iter_full(pkts[0].data, seg, from))
+                ret = -EFAULT;
+
+            /* Fixed width receivers expect the full payload, pad it. */
+            pkts[0].len = seg;
+            if (!dpl)
+            {
+                memset(pkts[0].data + seg, 0, NRF24_MAX_PAYLOAD - seg);
+                pkts[0].len = NRF24_MAX_PAYLOAD;
+            }
+        }
+        if (ret)
+            break;
+
+        /* Only the first packet may wait for room, later ones end the call early. */
+        if (fragment)
+            ret = nrf24_frag_queue(nrf, pkts, nfrags, queued || nrf24_nowait(iocb));
+        else
+        {
+            ret = 0;
+            while (!kfifo_in_spinlocked(&nrf->tx_fifo, &pkts[0], 1, &nrf->tx_lock))
+            {
+                if (queued || nrf24_nowait(iocb))
+                {
+                    ret = -EAGAIN;
+                    break;
+                }
+
+                ret = wait_event_interruptible(nrf->tx_wq, !kfifo_is_full(&nrf->tx_fifo));
+                if (ret)
+                    break;
+            }
+            if (!ret)
+                nrf24_engine_run(nrf);
+        }
+        if (ret)
+            break;
+
+        queued += seg;
+    }
+
+    kfree(pkts);
+    return queued ? queued : ret;
+}
+
+/* No IRQ line fills the pipe queues, STATUS tells if read() would find a packet. */
+static bool nrf24_poll_status(struct nrf24 *nrf)
+{
+    u32 period;
+    int ret;
+
+    nrf24_lock(nrf);
+    ret = nrf24_rx_check(nrf);
+    period = nrf->poll.max_interval_us;
+    nrf24_unlock(nrf);
+
+    if (ret > 0)
+        return true;
+
+    /* Nothing else would wake the waiter, look again after a poll period. */
+    hrtimer_start(&nrf->rx_wake_timer, us_to_ktime(period), HRTIMER_MODE_REL);
+    return false;
+}
+
+static __poll_t nrf24_poll(struct file *file, poll_table *wait)
+{
+    struct nrf24 *nrf = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &nrf->rx_wq, wait);
+    poll_wait(file, &nrf->tx_wq, wait);
+
+    if (nrf->irq <= 0)
+    {
+        if (nrf24_poll_status(nrf))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    else if (nrf24_rx_pending(nrf, ALL_PIPES) || nrf24_ring_pending(nrf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    if (!kfifo_is_full(&nrf->tx_fifo))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+static void nrf24_ring_free(struct kref *ref)
+{
+    struct nrf24_ring *ring = container_of(ref, struct nrf24_ring, ref);
+
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+/* VMAs only know the ring, the device may be gone already. */
+static void nrf24_ring_vm_open(struct vm_area_struct *vma)
+{
+    struct nrf24_ring *ring = vma->vm_private_data;
+    struct nrf24_ring_hdr *hdr = ring->mem;
+
+    kref_get(&ring->ref);
+
+    spin_lock_irq(&ring->lock);
+    /* First mapping starts from an empty ring. */
+    if (!ring->maps++)
+    {
+        hdr->head = 0;
+        hdr->tail = 0;
+    }
+    spin_unlock_irq(&ring->lock);
+}
+
+static void nrf24_ring_vm_close(struct vm_area_struct *vma)
+{
+    struct nrf24_ring *ring = vma->vm_private_data;
+
+    /* The producer checks maps under ring->lock, no slot is being written after this. */
+    spin_lock_irq(&ring->lock);
+    ring->maps--;
+    spin_unlock_irq(&ring->lock);
+
+    kref_put(&ring->ref, nrf24_ring_free);
+}
+
+static const struct vm_operations_struct nrf24_ring_vm_ops =
+{
+    .open  = nrf24_ring_vm_open,
+    .close = nrf24_ring_vm_close,
+};
+
+/* Maps the RX ring, NRF24_RING_SIZE at offset 0. */
+static int nrf24_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct nrf24 *nrf = file->private_data;
+    struct nrf24_ring *ring;
+    struct nrf24_ring_hdr *hdr;
+    int ret;
+
+    /* Ring is filled from the IRQ driven RX path. */
+    if (nrf->irq <= 0)
+        return -EOPNOTSUPP;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != NRF24_RING_SIZE)
+        return -EINVAL;
+
+    mutex_lock(&nrf->lock);
+    ring = nrf->ring;
+    if (!ring)
+    {
+        ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+        if (ring)
+            ring->mem = vmalloc_user(NRF24_RING_SIZE);
+        if (!ring || !ring->mem)
+        {
+            mutex_unlock(&nrf->lock);
+            kfree(ring);
+            return -ENOMEM;
+        }
+
+        kref_init(&ring->ref);
+        spin_lock_init(&ring->lock);
+        hdr = ring->mem;
+        hdr->slots = NRF24_RING_SLOTS;
+        hdr->slot_size = sizeof(struct nrf24_ring_slot);
+
+        spin_lock_irq(&nrf->engine_lock);
+        nrf->ring = ring;
+        spin_unlock_irq(&nrf->engine_lock);
+    }
+    mutex_unlock(&nrf->lock);
+
+    ret = remap_vmalloc_range(vma, ring->mem, 0);
+    if (ret)
+        return ret;
+
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &nrf24_ring_vm_ops;
+    vma->vm_private_data = ring;
+    nrf24_ring_vm_open(vma);
+
+    return 0;
+}
+
+static loff_t nrf24_llseek(struct file *file, loff_t offset, int whence)
+{
+    return generic_file_llseek(file, offset, whence);
+}
+
+static const struct file_operations nrf24_fops = 
+{
+    .owner          = THIS_MODULE,
+    .open           = nrf24_open,
+    .release        = nrf24_release,
+    .unlocked_ioctl = nrf24_ioctl,
+    .read           = nrf24_read,
+    .write          = nrf24_write,
+    .read_iter      = nrf24_read_iter,
+    .write_iter     = nrf24_write_iter,
+    .poll           = nrf24_poll,
+    .mmap           = nrf24_mmap,
+    .llseek         = nrf24_llseek,
+};
+
+/* Optional properties, ESB:
+   nordic,esb; nordic,crc-bytes = <n>; nordic,retransmit-delay-us = <us>;
+   nordic,retransmit-count = <n>; nordic,ack-payload;
+   Dynamic payload length: nordic,dynamic-payload;
+   Fragmentation, needs the IRQ line: nordic,fragmentation;
+   Stay powered up between sessions: nordic,warm-standby;
+   RF: nordic,data-rate-kbps = <250|1000|2000>; nordic,channel = <n>;
+   nordic,pa-dbm = <(-18)|(-12)|(-6)|0>; SPI clock from spi-max-frequency. */
+static void nrf24_parse_dt(struct nrf24 *nrf24)
+{
+    struct device_node *np = nrf24->device->dev.of_node;
+    struct nrf24_esb_config esb = { 0 };
+    struct nrf24_rf_config rf;
+    u32 val;
+    s32 dbm;
+
+    esb.enable = of_property_read_bool(np, "nordic,esb");
+    esb.ack_payload = of_property_read_bool(np, "nordic,ack-payload");
+    nrf24->dynpd = of_property_read_bool(np, "nordic,dynamic-payload");
+    nrf24->standby = of_property_read_bool(np, "nordic,warm-standby");
+    nrf24->fragment = of_property_read_bool(np, "nordic,fragmentation") && nrf24->device->irq > 0;
+    esb.crc_bytes = esb.enable ? 1 : 0;
+    esb.retr_delay_us = 500;
+    esb.retr_count = 3;
+
+    if (!of_property_read_u32(np, "nordic,crc-bytes", &val))
+        esb.crc_bytes = min_t(u32, val, U8_MAX);
+    if (!of_property_read_u32(np, "nordic,retransmit-delay-us", &val))
+        esb.retr_delay_us = min_t(u32, val, U16_MAX);
+    if (!of_property_read_u32(np, "nordic,retransmit-count", &val))
+        esb.retr_count = min_t(u32, val, U8_MAX);
+
+    if (nrf24_check_esb(&esb))
+        dev_warn(&nrf24->device->dev, "Invalid ESB properties, ESB disabled.\n");
+    else
+        nrf24->esb = esb;
+
+    rf.spi_hz = nrf24->device->max_speed_hz;
+    rf.data_rate_kbps = 2000;
+    rf.channel = 2;
+    rf.pa_dbm = 0;
+
+    if (!of_property_read_u32(np, "nordic,data-rate-kbps", &val))
+        rf.data_rate_kbps = min_t(u32, val, U16_MAX);
+    if (!of_property_read_u32(np, "nordic,channel", &val))
+        rf.channel = min_t(u32, val, U8_MAX);
+    if (!of_property_read_s32(np, "nordic,pa-dbm", &dbm))
+        rf.pa_dbm = clamp_t(s32, dbm, S8_MIN, S8_MAX);
+
+    if (nrf24_check_rf(&rf))
+    {
+        dev_warn(&nrf24->device->dev, "Invalid RF properties, chip defaults used.\n");
+        rf.data_rate_kbps = 2000;
+        rf.channel = 2;
+        rf.pa_dbm = 0;
+    }
+
+    nrf24->rf = rf;
+}
+
+static int nrf24_registers_show(struct seq_file *s, void *data)
+{
+    struct nrf24 *nrf24 = s->private;
+    int reg, i;
+
+    mutex_lock(&nrf24->lock);
+    seq_printf(s, "CE: %d\n", READ_ONCE(nrf24->ce));
+    for (reg = 0; reg < NRF24_NUM_REGS; reg++)
+    {
+        if (nrf24_reg_volatile(reg))
+            continue;
+
+        seq_printf(s, "%02x:", reg);
+        if (!nrf24->shadow_len[reg])
+            seq_puts(s, " --");
+        for (i = 0; i < nrf24->shadow_len[reg]; i++)
+            seq_printf(s, " %02x", nrf24->shadow[reg][i]);
+        seq_putc(s, '\n');
+    }
+    mutex_unlock(&nrf24->lock);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nrf24_registers);
+
+static void nrf24_hist_show(struct seq_file *s, const char *name, const u32 *hist)
+{
+    int i;
+
+    seq_printf(s, "%s:\n", name);
+    for (i = 0; i < NRF24_HIST_BUCKETS - 1; i++)
+        seq_printf(s, "  < %6lluus: %u\n", 1ULL << i, hist[i]);
+    seq_printf(s, "  >=%6lluus: %u\n", 1ULL << (NRF24_HIST_BUCKETS - 2), hist[i]);
+}
+
+static int nrf24_stats_show(struct seq_file *s, void *data)
+{
+    struct nrf24 *nrf24 = s->private;
+    struct nrf24_stats st;
+
+    /* Consistent copy, u64 updates are not atomic on 32 bit. */
+    mutex_lock(&nrf24->lock);
+    spin_lock_irq(&nrf24->engine_lock);
+    st = nrf24->stats;
+    spin_unlock_irq(&nrf24->engine_lock);
+    mutex_unlock(&nrf24->lock);
+
+    seq_printf(s, "tx_packets:  %llu\n", st.tx_packets);
+    seq_printf(s, "rx_packets:  %llu\n", st.rx_packets);
+    seq_printf(s, "rx_dropped:  %llu\n", st.rx_dropped);
+    seq_printf(s, "tx_timeouts: %llu\n", st.tx_timeouts);
+    seq_printf(s, "max_rt:      %llu\n", st.max_rt);
+    seq_printf(s, "retransmits: %llu\n", st.retransmits);
+    seq_printf(s, "lost:        %llu\n", st.lost);
+    seq_printf(s, "spi_async:   %llu\n", st.spi_async);
+    seq_printf(s, "spi_sync:    %llu\n", st.spi_sync);
+    seq_printf(s, "tx_bursts:   %llu\n", st.tx_bursts);
+    seq_printf(s, "polls:       %llu\n", st.polls);
+    nrf24_hist_show(s, "tx_to_tx_ds", st.tx_ds_hist);
+    nrf24_hist_show(s, "irq_to_read", st.irq_read_hist);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nrf24_stats);
+
+static int nrf24_pipe_open(struct inode *inode, struct file *file)
+{
+    struct miscdevice *misc = file->private_data;
+    struct nrf24_pipe *pipe = container_of(misc, struct nrf24_pipe, miscdev);
+
+    /* Pipe nodes only consume their queue, the radio is owned by the main node. */
+    if (pipe->nrf24->irq <= 0)
+        return -EOPNOTSUPP;
+
+    file->private_data = pipe;
+    /* read_iter honours IOCB_NOWAIT, io_uring may issue inline. */
+    file->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
+static ssize_t nrf24_pipe_read(struct file *file,
+                               char __user *ubuf,
+                               size_t count,
+                               loff_t *ppos)
+{
+    struct nrf24_pipe *pipe = file->private_data;
+
+    return nrf24_read_pipes(pipe->nrf24, 1 << pipe->index, file, ubuf, count);
+}
+
+static ssize_t nrf24_pipe_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct nrf24_pipe *pipe = iocb->ki_filp->private_data;
+
+    return nrf24_read_iter_pipes(pipe->nrf24, 1 << pipe->index, iocb, to);
+}
+
+static __poll_t nrf24_pipe_poll(struct file *file, poll_table *wait)
+{
+    struct nrf24_pipe *pipe = file->private_data;
+    struct nrf24 *nrf = pipe->nrf24;
+
+    poll_wait(file, &nrf->rx_wq, wait);
+
+    if (nrf24_rx_pending(nrf, 1 << pipe->index))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
+}
+
+static const struct file_operations nrf24_pipe_fops = 
+{
+    .owner          = THIS_MODULE,
+    .open           = nrf24_pipe_open,
+    .read           = nrf24_pipe_read,
+    .read_iter      = nrf24_pipe_read_iter,
+    .poll           = nrf24_pipe_poll,
+    .llseek         = nrf24_llseek,
+};
+
+static void nrf24_unregister_pipes(struct nrf24 *nrf24, int count)
+{
+    while (count--)
+        misc_deregister(&nrf24->pipes[count].miscdev);
+}
+
+static int nrf24_register_pipes(struct nrf24 *nrf24, u32 device_index)
+{
+    struct device *dev = &nrf24->device->dev;
+    struct nrf24_pipe *pipe;
+    int ret, i;
+
+    for (i = 0; i < NRF24_PIPES; i++)
+    {
+        pipe = &nrf24->pipes[i];
+        pipe->miscdev.minor  = MISC_DYNAMIC_MINOR;
+        pipe->miscdev.name   = devm_kasprintf(dev, GFP_KERNEL, "nrf24-%u-pipe%d",
+                                              device_index, i);
+        pipe->miscdev.fops   = &nrf24_pipe_fops;
+        pipe->miscdev.parent = dev;
+        ret = misc_register(&pipe->miscdev);
+        if (ret)
+        {
+            dev_err(dev, "Failed to register pipe %d miscdevice\n", i);
+            nrf24_unregister_pipes(nrf24, i);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Network personality: every IP packet is one fragmented message, from any pipe. */
+static struct nrf24 *nrf24_from_ndev(struct net_device *ndev)
+{
+    return *(struct nrf24 **)netdev_priv(ndev);
+}
+
+static int nrf24_net_open(struct net_device *ndev)
+{
+    struct nrf24 *nrf24 = nrf24_from_ndev(ndev);
+    int ret;
+    int i;
+
+    /* Addresses and CE gpio come from INIT_NRF24 on the misc device. */
+    if (!nrf24->initialized)
+    {
+        netdev_err(ndev, "Radio not initialized, INIT_NRF24 is needed first\n");
+        return -ENODEV;
+    }
+    if (READ_ONCE(nrf24->bonded))
+        return -EBUSY;
+
+    /* Closing the node used for INIT_NRF24 powered it down, unless in warm standby. */
+    ret = nrf24_power_up(nrf24);
+    if (ret)
+    {
+        netdev_err(ndev, "Failed to power up the radio: %d\n", ret);
+        return ret;
+    }
+
+    napi_enable(&nrf24->napi);
+
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->netdev_up = true;
+    for (i = 0; i < NRF24_PIPES; i++)
+        nrf24->pipes[i].reasm.count = 0;
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    netif_start_queue(ndev);
+    nrf24_start_listening(nrf24);
+
+    /* Whatever is queued already. */
+    nrf24_napi_kick(nrf24);
+    return 0;
+}
+
+static int nrf24_net_stop(struct net_device *ndev)
+{
+    struct nrf24 *nrf24 = nrf24_from_ndev(ndev);
+    int i;
+
+    netif_stop_queue(ndev);
+
+    /* NAPI reassembles in pipe->reasm without engine_lock, it must be done
+       before the engine's own message path may use it again. */
+    napi_disable(&nrf24->napi);
+
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->netdev_up = false;
+    for (i = 0; i < NRF24_PIPES; i++)
+        nrf24->pipes[i].reasm.count = 0;
+    spin_unlock_irq(&nrf24->engine_lock);
+    return 0;
+}
+
+static netdev_tx_t nrf24_net_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+    struct nrf24 *nrf24 = nrf24_from_ndev(ndev);
+    unsigned int nfrags = DIV_ROUND_UP(skb->len, NRF24_FRAG_DATA);
+    struct nrf24_packet pkt;
+    unsigned long flags;
+    unsigned int i;
+    size_t len;
+    u8 id;
+
+    if (!skb->len || skb->len > NRF24_FRAG_MAX_MSG)
+    {
+        ndev->stats.tx_dropped++;
+        dev_kfree_skb_any(skb);
+        return NETDEV_TX_OK;
+    }
+
+    /* All fragments or nothing, same as nrf24_write_message(). */
+    spin_lock_irqsave(&nrf24->tx_lock, flags);
+    if (kfifo_avail(&nrf24->tx_fifo) < nfrags)
+    {
+        netif_stop_queue(ndev);
+        spin_unlock_irqrestore(&nrf24->tx_lock, flags);
+        return NETDEV_TX_BUSY;
+    }
+
+    id = nrf24->tx_msg_id++;
+    for (i = 0; i < nfrags; i++)
+    {
+        len = min_t(size_t, skb->len - i * NRF24_FRAG_DATA, NRF24_FRAG_DATA);
+        skb_copy_bits(skb, i * NRF24_FRAG_DATA, pkt.data + NRF24_FRAG_HDR, len);
+        nrf24_frag_fill(nrf24, &pkt, i, nfrags, len);
+        ((struct nrf24_frag_hdr *)pkt.data)->id = id;
+        kfifo_in(&nrf24->tx_fifo, &pkt, 1);
+    }
+
+    /* Stop before the next one fails, the engine wakes the queue. */
+    if (kfifo_avail(&nrf24->tx_fifo) < NRF24_NET_MAX_FRAGS)
+        netif_stop_queue(ndev);
+    spin_unlock_irqrestore(&nrf24->tx_lock, flags);
+
+    ndev->stats.tx_packets++;
+    ndev->stats.tx_bytes += skb->len;
+    dev_consume_skb_any(skb);
+
+    nrf24_engine_run(nrf24);
+    return NETDEV_TX_OK;
+}
+
+/* Drains up to budget payloads from the pipe queues, round robin. */
+static int nrf24_napi_poll(struct napi_struct *napi, int budget)
+{
+    struct nrf24 *nrf24 = container_of(napi, struct nrf24, napi);
+    struct net_device *ndev = nrf24->ndev;
+    struct nrf24_packet pkt;
+    struct nrf24_reasm *r;
+    struct sk_buff *skb;
+    bool got;
+    int work = 0;
+    int i;
+
+    do
+    {
+        got = false;
+        for (i = 0; i < NRF24_PIPES && work < budget; i++)
+        {
+            if (!kfifo_out_spinlocked(&nrf24->pipes[i].rx_fifo, &pkt, 1, &nrf24->rx_lock))
+                continue;
+            got = true;
+            work++;
+
+            if (!nrf24_reasm_add(nrf24, &nrf24->pipes[i], &pkt))
+                continue;
+
+            /* Raw IPv4, the MTU is below the 1280 bytes IPv6 needs. */
+            r = &nrf24->pipes[i].reasm;
+            if ((r->data[0] >> 4) != 4)
+            {
+                ndev->stats.rx_errors++;
+                continue;
+            }
+
+            skb = napi_alloc_skb(napi, r->len);
+            if (!skb)
+            {
+                ndev->stats.rx_dropped++;
+                continue;
+            }
+            skb_put_data(skb, r->data, r->len);
+
+            skb->protocol = htons(ETH_P_IP);
+            skb_reset_mac_header(skb);
+            skb_reset_network_header(skb);
+
+            ndev->stats.rx_packets++;
+            ndev->stats.rx_bytes += r->len;
+            napi_gro_receive(napi, skb);
+        }
+    } while (got && work < budget);
+
+    /* A payload queued after the last check found NAPI still scheduled. */
+    if (work < budget && napi_complete_done(napi, work) &&
+        nrf24_rx_pending(nrf24, ALL_PIPES))
+        napi_schedule(napi);
+
+    return work;
+}
+
+static const struct net_device_ops nrf24_netdev_ops =
+{
+    .ndo_open       = nrf24_net_open,
+    .ndo_stop       = nrf24_net_stop,
+    .ndo_start_xmit = nrf24_net_xmit,
+};
+
+static void nrf24_net_setup(struct net_device *ndev)
+{
+    ndev->netdev_ops      = &nrf24_netdev_ops;
+    ndev->type            = ARPHRD_NONE;
+    ndev->flags           = IFF_POINTOPOINT | IFF_NOARP;
+    ndev->hard_header_len = 0;
+    ndev->addr_len        = 0;
+    ndev->mtu             = NRF24_FRAG_MAX_MSG;
+    ndev->min_mtu         = 68;
+    ndev->max_mtu         = NRF24_FRAG_MAX_MSG; /* IPv4 only, IPv6 needs 1280 */
+    ndev->tx_queue_len    = 100;
+}
+
+static int nrf24_net_register(struct nrf24 *nrf24)
+{
+    struct net_device *ndev;
+    int ret;
+
+    ndev = alloc_netdev(sizeof(nrf24), "nrf%d", NET_NAME_UNKNOWN, nrf24_net_setup);
+    if (!ndev)
+        return -ENOMEM;
+
+    *(struct nrf24 **)netdev_priv(ndev) = nrf24;
+    SET_NETDEV_DEV(ndev, &nrf24->device->dev);
+    netif_napi_add(ndev, &nrf24->napi, nrf24_napi_poll);
+
+    ret = register_netdev(ndev);
+    if (ret)
+    {
+        netif_napi_del(&nrf24->napi);
+        free_netdev(ndev);
+        return ret;
+    }
+
+    nrf24->ndev = ndev;
+    return 0;
+}
+
+static void nrf24_net_unregister(struct nrf24 *nrf24)
+{
+    if (!nrf24->ndev)
+        return;
+
+    unregister_netdev(nrf24->ndev);
+    netif_napi_del(&nrf24->napi);
+    free_netdev(nrf24->ndev);
+    nrf24->ndev = NULL;
+}
+
+/* Bonding: the radios marked nordic,bond stripe one byte stream, /dev/nrf24-bond.
+   Packet n goes to member n % count, every radio on its own channel, the receiver
+   puts them back in order by sequence number. */
+static void nrf24_bond_put(struct nrf24_bond *bond, const struct nrf24_packet *pkt)
+{
+    const struct nrf24_bond_hdr *hdr = (const struct nrf24_bond_hdr *)pkt->data;
+
+    if (kfifo_avail(&bond->rx_fifo) < hdr->len)
+    {
+        bond->rx_dropped++;
+        dev_warn_ratelimited(bond->miscdev.this_device, "RX queue full, packet dropped.\n");
+        return;
+    }
+
+    kfifo_in(&bond->rx_fifo, pkt->data + NRF24_BOND_HDR, hdr->len);
+}
+
+/* rx_lock held. Hands over everything in order from rx_seq on, true if anything went. */
+static bool nrf24_bond_deliver(struct nrf24_bond *bond)
+{
+    struct nrf24_packet *slot;
+    bool delivered = false;
+
+    for (;;)
+    {
+        slot = &bond->rx_win[bond->rx_seq % NRF24_BOND_WINDOW];
+        if (!slot->len)
+            return delivered;
+
+        nrf24_bond_put(bond, slot);
+        slot->len = 0;
+        bond->rx_held--;
+        bond->rx_seq++;
+        delivered = true;
+    }
+}
+
+/* rx_lock held. Gives up on the missing packets before seq. */
+static void nrf24_bond_skip(struct nrf24_bond *bond, u16 seq)
+{
+    struct nrf24_packet *slot;
+
+    while ((s16)(seq - bond->rx_seq) > 0)
+    {
+        slot = &bond->rx_win[bond->rx_seq % NRF24_BOND_WINDOW];
+        if (slot->len)
         {
-            dev_err(nrf24->miscdev.this_device, "Error getting gpio descripter : %llu", nrf24->config.ce_gpio);
-            return -EINVAL; // Invalid argument.
+            nrf24_bond_put(bond, slot);
+            slot->len = 0;
+            bond->rx_held--;
         }
+        else
+            bond->rx_lost++;
+        bond->rx_seq++;
+    }
+}
 
-        ret = gpiod_direction_output(nrf24->ce_gpio, 0); // Default low.
-        if (ret)
+/* rx_lock held. A new stream from the sender: hands over what is left of the old
+   one and waits for seq 0, unless the receiver came in late. */
+static void nrf24_bond_resync(struct nrf24_bond *bond, u8 session, u16 seq)
+{
+    struct nrf24_packet *slot;
+
+    while (bond->rx_held)
+    {
+        slot = &bond->rx_win[bond->rx_seq % NRF24_BOND_WINDOW];
+        if (slot->len)
         {
-            dev_err(nrf24->miscdev.this_device, "Error setting pin %llu as output\n", nrf24->config.ce_gpio);
-            return ret;
+            nrf24_bond_put(bond, slot);
+            slot->len = 0;
+            bond->rx_held--;
         }
+        else
+            bond->rx_lost++;
+        bond->rx_seq++;
+    }
 
-        ret = nrf24_write_regs(nrf24, REG_RX_ADDR_P0, nrf24->config.rx_address, 5);
-        ret = nrf24_write_regs(nrf24, REG_TX_ADDR, nrf24->config.tx_address, 5);
-        ret = nrf24_init_defaults(nrf24);
-        return ret;
+    bond->rx_session = session;
+    bond->rx_seq = seq < NRF24_BOND_WINDOW ? 0 : seq;
+    bond->rx_synced = true;
+}
+
+/* rx_lock held. The oldest missing packet gets NRF24_BOND_GAP_MS to show up. */
+static void nrf24_bond_gap_timer_update(struct nrf24_bond *bond)
+{
+    if (!bond->rx_held)
+        hrtimer_try_to_cancel(&bond->gap_timer);
+    else if (!hrtimer_is_queued(&bond->gap_timer))
+        hrtimer_start(&bond->gap_timer, ms_to_ktime(NRF24_BOND_GAP_MS), HRTIMER_MODE_REL);
+}
+
+/* From the engine of any member, engine_lock held. */
+static void nrf24_bond_rx(const struct nrf24_packet *pkt)
+{
+    struct nrf24_bond *bond = &nrf24_bond;
+    const struct nrf24_bond_hdr *hdr = (const struct nrf24_bond_hdr *)pkt->data;
+    u16 seq = le16_to_cpu(hdr->seq);
+    unsigned long flags;
+    bool wake;
+
+    if (!hdr->len || hdr->len > NRF24_BOND_DATA || pkt->len < NRF24_BOND_HDR + hdr->len)
+        return;
+
+    spin_lock_irqsave(&bond->rx_lock, flags);
+
+    /* Members deliver out of order, seq 1 may well come before seq 0. A sender
+       that restarted without a new session shows up as a big step back. */
+    if (!bond->rx_synced || hdr->session != bond->rx_session ||
+        (s16)(seq - bond->rx_seq) < -NRF24_BOND_WINDOW)
+        nrf24_bond_resync(bond, hdr->session, seq);
+
+    /* Already delivered or given up on. */
+    if ((s16)(seq - bond->rx_seq) < 0)
+    {
+        spin_unlock_irqrestore(&bond->rx_lock, flags);
+        return;
     }
-    default:
-        return -1;
+
+    /* Beyond the window, the oldest missing ones won't come anymore. */
+    if ((u16)(seq - bond->rx_seq) >= NRF24_BOND_WINDOW)
+        nrf24_bond_skip(bond, seq - NRF24_BOND_WINDOW + 1);
+
+    if (!bond->rx_win[seq % NRF24_BOND_WINDOW].len)
+    {
+        bond->rx_win[seq % NRF24_BOND_WINDOW] = *pkt;
+        bond->rx_held++;
+    }
+
+    wake = nrf24_bond_deliver(bond);
+    nrf24_bond_gap_timer_update(bond);
+    spin_unlock_irqrestore(&bond->rx_lock, flags);
+
+    if (wake)
+        wake_up_interruptible(&bond->rx_wq);
+}
+
+/* Any member, its TX queue got room or was dropped. */
+static void nrf24_bond_tx_wake(struct nrf24 *nrf24)
+{
+    if (!READ_ONCE(nrf24->bonded))
+        return;
+
+    atomic_inc(&nrf24_bond.tx_room);
+    wake_up_interruptible(&nrf24_bond.tx_wq);
+}
+
+/* A packet is missing for too long, go on with the next one there is. */
+static enum hrtimer_restart nrf24_bond_gap_timeout(struct hrtimer *timer)
+{
+    struct nrf24_bond *bond = container_of(timer, struct nrf24_bond, gap_timer);
+    unsigned long flags;
+    bool gap;
+    u16 seq;
+
+    spin_lock_irqsave(&bond->rx_lock, flags);
+    seq = bond->rx_seq;
+    while (bond->rx_held && !bond->rx_win[seq % NRF24_BOND_WINDOW].len)
+        seq++;
+    nrf24_bond_skip(bond, seq);
+    nrf24_bond_deliver(bond);
+    gap = bond->rx_held;
+    spin_unlock_irqrestore(&bond->rx_lock, flags);
+
+    wake_up_interruptible(&bond->rx_wq);
+
+    if (!gap)
+        return HRTIMER_NORESTART;
+
+    hrtimer_forward_now(timer, ms_to_ktime(NRF24_BOND_GAP_MS));
+    return HRTIMER_RESTART;
+}
+
+static int nrf24_bond_open(struct inode *inode, struct file *file)
+{
+    struct nrf24_bond *bond = &nrf24_bond;
+    struct nrf24 *nrf;
+    unsigned int i, j;
+    int ret = 0;
+
+    mutex_lock(&nrf24_bond_lock);
+    if (bond->open)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (!bond->count)
+    {
+        ret = -ENODEV;
+        goto out;
+    }
+
+    /* Members are set up through their own nodes, INIT_NRF24 and NRF24_SET_RF. */
+    for (i = 0; i < bond->count; i++)
+    {
+        nrf = bond->members[i];
+        if (!nrf->initialized || READ_ONCE(nrf->netdev_up))
+        {
+            dev_err(bond->miscdev.this_device, "%s is not initialized or in use\n",
+                    nrf->miscdev.name);
+            ret = -EBUSY;
+            goto out;
+        }
+
+        for (j = 0; j < i; j++)
+            if (bond->members[j]->rf.channel == nrf->rf.channel)
+            {
+                dev_err(bond->miscdev.this_device, "%s and %s share channel %u\n",
+                        bond->members[j]->miscdev.name, nrf->miscdev.name, nrf->rf.channel);
+                ret = -EINVAL;
+                goto out;
+            }
+    }
+
+    /* initialized stays set after release() powered a member down. */
+    for (i = 0; i < bond->count; i++)
+    {
+        ret = nrf24_power_up(bond->members[i]);
+        if (ret)
+        {
+            dev_err(bond->miscdev.this_device, "Failed to power up %s: %d\n",
+                    bond->members[i]->miscdev.name, ret);
+            goto out;
+        }
+    }
+
+    spin_lock_irq(&bond->rx_lock);
+    bond->rx_synced = false;
+    bond->rx_held = 0;
+    for (i = 0; i < NRF24_BOND_WINDOW; i++)
+        bond->rx_win[i].len = 0;
+    kfifo_reset(&bond->rx_fifo);
+    spin_unlock_irq(&bond->rx_lock);
+    /* The receiver tells this stream from the last one by the session. */
+    bond->tx_session += 1 + get_random_u32() % U8_MAX;
+    bond->tx_seq = 0;
+    bond->tx_next = 0;
+
+    for (i = 0; i < bond->count; i++)
+    {
+        nrf = bond->members[i];
+        spin_lock_irq(&nrf->engine_lock);
+        nrf->bonded = true;
+        spin_unlock_irq(&nrf->engine_lock);
+        nrf24_start_listening(nrf);
     }
+    bond->open = true;
 
+out:
+    mutex_unlock(&nrf24_bond_lock);
     return ret;
 }
 
-static ssize_t nrf24_read(struct file *file,
-                          char __user *ubuf,
-                          size_t count,
-                          loff_t *ppos)
+static int nrf24_bond_release(struct inode *inode, struct file *file)
 {
-    struct nrf24 *nrf = file->private_data;
-    u8 buf[NRF24_MAX_PAYLOAD];
-    size_t len;
-    int ret;
+    struct nrf24_bond *bond = &nrf24_bond;
+    struct nrf24 *nrf;
+    unsigned int i;
 
-    /* Limit to max payload */
-    if (count > NRF24_MAX_PAYLOAD)
-        return -EINVAL;
-    len = count;
+    mutex_lock(&nrf24_bond_lock);
+    for (i = 0; i < bond->count; i++)
+    {
+        nrf = bond->members[i];
+        spin_lock_irq(&nrf->engine_lock);
+        nrf->bonded = false;
+        spin_unlock_irq(&nrf->engine_lock);
+    }
+    hrtimer_cancel(&bond->gap_timer);
+    bond->open = false;
+    mutex_unlock(&nrf24_bond_lock);
+
+    return 0;
+}
+
+static ssize_t nrf24_bond_read(struct file *file, char __user *ubuf,
+                               size_t count, loff_t *ppos)
+{
+    struct nrf24_bond *bond = &nrf24_bond;
+    unsigned int copied;
+    int ret;
 
-    ret = nrf24_receive(nrf, buf, len);
+    ret = mutex_lock_interruptible(&bond->read_lock);
     if (ret)
         return ret;
 
-    if (copy_to_user(ubuf, buf, len))
-        return -EFAULT;
+    while (kfifo_is_empty(&bond->rx_fifo))
+    {
+        if (file->f_flags & O_NONBLOCK)
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+
+        ret = wait_event_interruptible(bond->rx_wq, !kfifo_is_empty(&bond->rx_fifo));
+        if (ret)
+            goto out;
+    }
 
-    return len;
+    /* Single reader under read_lock, single writer under rx_lock. */
+    ret = kfifo_to_user(&bond->rx_fifo, ubuf, count, &copied);
+
+out:
+    mutex_unlock(&bond->read_lock);
+    return ret ? ret : copied;
 }
 
-static ssize_t nrf24_write(struct file *file,
-                           const char __user *ubuf,
-                           size_t count,
-                           loff_t *ppos)
+static ssize_t nrf24_bond_write(struct file *file, const char __user *ubuf,
+                                size_t count, loff_t *ppos)
 {
-    struct nrf24 *nrf = file->private_data;
-    u8 buf[NRF24_MAX_PAYLOAD];
+    struct nrf24_bond *bond = &nrf24_bond;
+    struct nrf24_packet pkt;
+    struct nrf24_bond_hdr *hdr = (struct nrf24_bond_hdr *)pkt.data;
+    struct nrf24 *nrf;
+    size_t queued = 0;
     size_t len;
-    int ret;
+    int room;
+    int ret = 0;
 
-    /* Limit to max payload */
-    if (count > NRF24_MAX_PAYLOAD)
-        return -EINVAL;
-    len = count;
+    while (queued < count)
+    {
+        len = min_t(size_t, count - queued, NRF24_BOND_DATA);
+        memset(pkt.data, 0, sizeof(pkt.data));
+        if (copy_from_user(pkt.data + NRF24_BOND_HDR, ubuf + queued, len))
+        {
+            ret = -EFAULT;
+            break;
+        }
 
-    if (copy_from_user(buf, ubuf, len))
-        return -EFAULT;
+        /* Per packet, a member leaving on remove() has to get in between. */
+        ret = mutex_lock_interruptible(&nrf24_bond_lock);
+        if (ret)
+            break;
+        if (!bond->count)
+        {
+            mutex_unlock(&nrf24_bond_lock);
+            ret = -ENODEV;
+            break;
+        }
 
-    ret = nrf24_send(nrf, buf, len);
-    if (ret)
-        return ret; 
+        nrf = bond->members[bond->tx_next];
+        hdr->session = bond->tx_session;
+        hdr->seq = cpu_to_le16(bond->tx_seq);
+        hdr->len = len;
+        pkt.len = nrf24_dpl_enabled(nrf) ? NRF24_BOND_HDR + len : NRF24_MAX_PAYLOAD;
+
+        /* Strict round robin, the members run at the same rate and stay in step.
+           Seq and member are only taken once the packet is in, a full member is
+           waited for without the lock and tried again. */
+        room = atomic_read(&bond->tx_room);
+        if (kfifo_in_spinlocked(&nrf->tx_fifo, &pkt, 1, &nrf->tx_lock))
+        {
+            bond->tx_seq++;
+            bond->tx_next = (bond->tx_next + 1) % bond->count;
+            nrf24_engine_run(nrf);
+            mutex_unlock(&nrf24_bond_lock);
+            queued += len;
+            continue;
+        }
+        mutex_unlock(&nrf24_bond_lock);
+
+        if (file->f_flags & O_NONBLOCK)
+        {
+            ret = -EAGAIN;
+            break;
+        }
+
+        ret = wait_event_interruptible(bond->tx_wq, atomic_read(&bond->tx_room) != room);
+        if (ret)
+            break;
+    }
 
-    return len;  /* Number of bytes sent */
+    return queued ? queued : ret;
 }
 
-static loff_t nrf24_llseek(struct file *file, loff_t offset, int whence)
+static __poll_t nrf24_bond_poll(struct file *file, poll_table *wait)
 {
-    return generic_file_llseek(file, offset, whence);
+    struct nrf24_bond *bond = &nrf24_bond;
+    struct nrf24 *nrf;
+    __poll_t mask = 0;
+
+    poll_wait(file, &bond->rx_wq, wait);
+    poll_wait(file, &bond->tx_wq, wait);
+    if (!kfifo_is_empty(&bond->rx_fifo))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    mutex_lock(&nrf24_bond_lock);
+    if (bond->count)
+    {
+        nrf = bond->members[bond->tx_next];
+        if (!kfifo_is_full(&nrf->tx_fifo))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    mutex_unlock(&nrf24_bond_lock);
+
+    return mask;
 }
 
-static const struct file_operations nrf24_fops = 
+/* /sys/kernel/debug/nrf24-bond/stats */
+static int nrf24_bond_stats_show(struct seq_file *s, void *data)
 {
-    .owner          = THIS_MODULE,
-    .open           = nrf24_open,
-    .release        = nrf24_release,
-    .unlocked_ioctl = nrf24_ioctl,
-    .read           = nrf24_read,
-    .write          = nrf24_write,
-    .llseek         = nrf24_llseek,
+    struct nrf24_bond *bond = s->private;
+    u64 lost, dropped;
+    unsigned int held;
+
+    spin_lock_irq(&bond->rx_lock);
+    lost = bond->rx_lost;
+    dropped = bond->rx_dropped;
+    held = bond->rx_held;
+    spin_unlock_irq(&bond->rx_lock);
+
+    seq_printf(s, "members:    %u\n", bond->count);
+    seq_printf(s, "rx_held:    %u\n", held);
+    seq_printf(s, "rx_lost:    %llu\n", lost);
+    seq_printf(s, "rx_dropped: %llu\n", dropped);
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(nrf24_bond_stats);
+
+static const struct file_operations nrf24_bond_fops =
+{
+    .owner   = THIS_MODULE,
+    .open    = nrf24_bond_open,
+    .release = nrf24_bond_release,
+    .read    = nrf24_bond_read,
+    .write   = nrf24_bond_write,
+    .poll    = nrf24_bond_poll,
+    .llseek  = no_llseek,
 };
 
+/* nordic,bond on probe, /dev/nrf24-bond comes with the first member. */
+static int nrf24_bond_join(struct nrf24 *nrf24)
+{
+    struct nrf24_bond *bond = &nrf24_bond;
+    int ret = 0;
+
+    mutex_lock(&nrf24_bond_lock);
+    if (bond->count == NRF24_BOND_MAX)
+    {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    if (!bond->count)
+    {
+        spin_lock_init(&bond->rx_lock);
+        init_waitqueue_head(&bond->rx_wq);
+        init_waitqueue_head(&bond->tx_wq);
+        mutex_init(&bond->read_lock);
+        INIT_KFIFO(bond->rx_fifo);
+        hrtimer_init(&bond->gap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        bond->gap_timer.function = nrf24_bond_gap_timeout;
+
+        bond->miscdev.minor = MISC_DYNAMIC_MINOR;
+        bond->miscdev.name  = "nrf24-bond";
+        bond->miscdev.fops  = &nrf24_bond_fops;
+        ret = misc_register(&bond->miscdev);
+        if (ret)
+            goto out;
+
+        bond->debugfs = debugfs_create_dir("nrf24-bond", NULL);
+        debugfs_create_file("stats", 0444, bond->debugfs, bond, &nrf24_bond_stats_fops);
+    }
+
+    bond->members[bond->count++] = nrf24;
+
+out:
+    mutex_unlock(&nrf24_bond_lock);
+    return ret;
+}
+
+static void nrf24_bond_leave(struct nrf24 *nrf24)
+{
+    struct nrf24_bond *bond = &nrf24_bond;
+    unsigned int i;
+
+    mutex_lock(&nrf24_bond_lock);
+    for (i = 0; i < bond->count; i++)
+        if (bond->members[i] == nrf24)
+            break;
+
+    if (i < bond->count)
+    {
+        memmove(&bond->members[i], &bond->members[i + 1],
+                (bond->count - i - 1) * sizeof(bond->members[0]));
+        bond->count--;
+        bond->tx_next = bond->count ? bond->tx_next % bond->count : 0;
+
+        spin_lock_irq(&nrf24->engine_lock);
+        nrf24->bonded = false;
+        spin_unlock_irq(&nrf24->engine_lock);
+
+        /* A writer waiting for this member goes on with the next one. */
+        atomic_inc(&bond->tx_room);
+        wake_up_interruptible(&bond->tx_wq);
+
+        if (!bond->count)
+        {
+            hrtimer_cancel(&bond->gap_timer);
+            debugfs_remove_recursive(bond->debugfs);
+            misc_deregister(&bond->miscdev);
+        }
+    }
+    mutex_unlock(&nrf24_bond_lock);
+}
+
+/* Locks, queues and timers, everything probe() sets up before the chip is touched. */
+static void nrf24_init_state(struct nrf24 *nrf24, struct spi_device *device)
+{
+    /* They should point to each other. */
+    nrf24->device = device;
+    spi_set_drvdata(device, nrf24);
+
+    mutex_init(&nrf24->lock);
+    for (int i = 0; i < NRF24_PIPES; i++)
+    {
+        nrf24->pipes[i].nrf24 = nrf24;
+        nrf24->pipes[i].index = i;
+        INIT_KFIFO(nrf24->pipes[i].rx_fifo);
+        INIT_KFIFO(nrf24->pipes[i].msg_fifo);
+    }
+    spin_lock_init(&nrf24->rx_lock);
+    init_waitqueue_head(&nrf24->rx_wq);
+    mutex_init(&nrf24->msg_lock);
+    INIT_KFIFO(nrf24->tx_fifo);
+    spin_lock_init(&nrf24->tx_lock);
+    init_waitqueue_head(&nrf24->tx_wq);
+    spin_lock_init(&nrf24->engine_lock);
+    init_waitqueue_head(&nrf24->engine_wq);
+    nrf24->status = STATUS_RX_P_NO; /* RX FIFO empty until STATUS says otherwise. */
+    hrtimer_init(&nrf24->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nrf24->tx_timer.function = nrf24_tx_timeout;
+    hrtimer_init(&nrf24->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nrf24->poll_timer.function = nrf24_poll_timer;
+    nrf24->poll.interval_us     = NRF24_POLL_US;
+    nrf24->poll.max_interval_us = NRF24_POLL_MAX_US;
+    nrf24->poll.rx_timeout_us   = NRF24_POLL_RX_TIMEOUT_US;
+    hrtimer_init(&nrf24->sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    nrf24->sched_timer.function = nrf24_sched_timer;
+    hrtimer_init(&nrf24->retry_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nrf24->retry_timer.function = nrf24_retry_timer;
+    hrtimer_init(&nrf24->rx_wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nrf24->rx_wake_timer.function = nrf24_rx_wake_timer;
+}
+
 static int nrf24_probe(struct spi_device *device)
 {
     struct nrf24 *nrf24;
@@ -454,15 +4032,32 @@ static int nrf24_probe(struct spi_device *device)
     if (!nrf24)
         return -ENOMEM;
 
-    /* They should point to each other. */
-    nrf24->device = device;
-    spi_set_drvdata(device, nrf24);
+    nrf24_init_state(nrf24, device);
 
-    device->max_speed_hz = 1000000; // 1Mhz
+    /* spi-max-frequency from DT if given, the chip takes up to 10MHz. */
+    if (!device->max_speed_hz)
+        device->max_speed_hz = NRF24_SPI_DEFAULT_HZ;
+    device->max_speed_hz = min_t(u32, device->max_speed_hz, NRF24_SPI_MAX_HZ);
     device->bits_per_word = 8;
     device->mode = SPI_MODE_0;
     spi_setup(device);
 
+    nrf24_parse_dt(nrf24);
+
+    /* Optional "interrupts" property, active low IRQ pin of the nrf24. */
+    if (device->irq > 0)
+    {
+        /* Hard handler, it only kicks the engine. */
+        ret = devm_request_irq(&device->dev, device->irq, nrf24_irq, 0,
+                               dev_name(&device->dev), nrf24);
+        if (ret)
+        {
+            dev_err(&device->dev, "Failed to request irq %d: %d\n", device->irq, ret);
+            return ret;
+        }
+        nrf24->irq = device->irq;
+    }
+
     nrf24->miscdev.minor  = MISC_DYNAMIC_MINOR;
 
     /* Register all found devices from dt, device name nrf24-<index from 0> */
@@ -480,13 +4075,64 @@ static int nrf24_probe(struct spi_device *device)
         return ret;
     }
 
+    ret = nrf24_register_pipes(nrf24, device_index);
+    if (ret)
+    {
+        misc_deregister(&nrf24->miscdev);
+        return ret;
+    }
+
+    /* /sys/kernel/debug/nrf24-<index>/registers dumps the shadow, stats the counters. */
+    nrf24->debugfs = debugfs_create_dir(nrf24->miscdev.name, NULL);
+    debugfs_create_file("registers", 0444, nrf24->debugfs, nrf24, &nrf24_registers_fops);
+    debugfs_create_file("stats", 0444, nrf24->debugfs, nrf24, &nrf24_stats_fops);
+
+    /* Optional "nordic,netdev", the RX path behind it needs the IRQ line. */
+    if (of_property_read_bool(device->dev.of_node, "nordic,netdev"))
+    {
+        if (nrf24->irq <= 0)
+            dev_warn(&device->dev, "nordic,netdev needs an interrupt, no network interface\n");
+        else if (nrf24_net_register(nrf24))
+            dev_warn(&device->dev, "Failed to register network interface\n");
+    }
+
+    /* Optional "nordic,bond", stripes /dev/nrf24-bond over all such radios. */
+    if (of_property_read_bool(device->dev.of_node, "nordic,bond"))
+    {
+        if (nrf24->irq <= 0)
+            dev_warn(&device->dev, "nordic,bond needs an interrupt, not bonded\n");
+        else if (nrf24_bond_join(nrf24))
+            dev_warn(&device->dev, "Failed to join the bond\n");
+    }
+
     return 0;
 }
 
 static void nrf24_remove(struct spi_device *device)
 {
     struct nrf24 *nrf24 = spi_get_drvdata(device);
+
+    nrf24_net_unregister(nrf24);
+    nrf24_bond_leave(nrf24);
+    debugfs_remove_recursive(nrf24->debugfs);
+    nrf24_unregister_pipes(nrf24, NRF24_PIPES);
     misc_deregister(&nrf24->miscdev);
+    nrf24_tx_cancel(nrf24);
+
+    /* Engine stays quiesced, nothing may touch the chip anymore. */
+    nrf24_lock(nrf24);
+    if (nrf24->irq > 0)
+        disable_irq(nrf24->irq);
+    hrtimer_cancel(&nrf24->tx_timer);
+    hrtimer_cancel(&nrf24->poll_timer);
+    hrtimer_cancel(&nrf24->sched_timer);
+    hrtimer_cancel(&nrf24->retry_timer);
+    hrtimer_cancel(&nrf24->rx_wake_timer);
+    mutex_unlock(&nrf24->lock);
+
+    /* Nothing produces anymore, mappings keep the memory until munmap(). */
+    if (nrf24->ring)
+        kref_put(&nrf24->ring->ref, nrf24_ring_free);
 }
 
 static const struct of_device_id nrf24_idtable[] = 
@@ -513,4 +4159,8 @@ module_spi_driver(nrf24_driver);
 
 MODULE_AUTHOR("Ozgur Ayik");
 MODULE_DESCRIPTION("Custom nrf24 misc-device driver");
-MODULE_LICENSE("GPL");
\ No newline at end of file
+MODULE_LICENSE("GPL");
+
+#ifdef NRF24_KUNIT_TEST
+#include "test/nrf24_kunit.c"
+#endif
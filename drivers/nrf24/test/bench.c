@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define INIT_NRF24            _IO('G', 0)
+#define NRF24_SET_DYNPD       _IOW('G', 3, int)
+#define NRF24_SET_READ_FORMAT _IOW('G', 8, int)
+#define NRF24_READ_RAW        0
+#define NRF24_READ_META       1
+#define PAYLOAD_SIZE          32
+
+/* Every benchmark packet starts with this, the rest is a fill pattern. */
+#define HDR_SIZE 12 /* u32 seq, u64 CLOCK_MONOTONIC ns of the send, little endian */
+
+struct nrf24_config
+{
+    uint64_t ce_gpio; /* GPIO number of CE pin */
+    uint8_t tx_address[5];
+    uint8_t rx_address[5];
+};
+
+enum mode
+{
+    MODE_PING,  /* Send, wait for the echo, RTT per packet */
+    MODE_FLOOD, /* Send paced or as fast as possible, the sink counts */
+    MODE_ECHO,  /* Peer of ping: write back every packet read */
+    MODE_SINK,  /* Peer of flood */
+};
+
+struct options
+{
+    enum mode mode;
+    const char *dev_a;   /* Radio of this side */
+    const char *dev_b;   /* Peer radio on the same host, the peer side runs in a child. */
+    uint64_t gpio_a;
+    uint64_t gpio_b;
+    int size;            /* Payload bytes, below 32 needs dynamic payload length. */
+    long count;
+    long interval_us;    /* Pacing, 0 sends back to back */
+    int timeout_ms;      /* Echo wait of ping, idle end of the sink */
+    int no_init;         /* Device already configured or emulated, skip the ioctls. */
+    int json;
+};
+
+/* Result of the sink, passed to the parent through a pipe in two-radio mode. */
+struct sink_result
+{
+    long received;
+    long duplicates;
+    long reordered;
+    uint32_t max_seq;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t lat_min_ns; /* One way, only meaningful on the same host */
+    uint64_t lat_sum_ns;
+    uint64_t lat_max_ns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static void fill_packet(uint8_t *buf, int size, uint32_t seq)
+{
+    put_le(buf, seq, 4);
+    put_le(buf + 4, now_ns(), 8);
+    for (int i = HDR_SIZE; i < size; i++)
+        buf[i] = seq + i;
+}
+
+/* The overlay in ../dt wires nrf24-0 and nrf24-1 to each other, same addresses as main.c. */
+static int setup_radio(const char *path, uint64_t gpio, int first, const struct options *opt,
+                       int *polled)
+{
+    struct nrf24_config cfg =
+    {
+        .ce_gpio    = gpio,
+        .tx_address = { 0xE7, 0xE7, 0xE7, 0xE7, first ? 0xE5 : 0xE7 },
+        .rx_address = { 0xE7, 0xE7, 0xE7, 0xE7, first ? 0xE7 : 0xE5 },
+    };
+    int dynpd = opt->size < PAYLOAD_SIZE;
+    int format = NRF24_READ_META;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    *polled = 0;
+    if (opt->no_init)
+        return fd;
+
+    if (ioctl(fd, INIT_NRF24, &cfg) < 0)
+    {
+        fprintf(stderr, "ioctl INIT_NRF24 %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (ioctl(fd, NRF24_SET_DYNPD, &dynpd) < 0)
+    {
+        fprintf(stderr, "ioctl NRF24_SET_DYNPD %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Only radios with an IRQ line support META, the others are polled by read(). */
+    if (ioctl(fd, NRF24_SET_READ_FORMAT, &format) < 0 && errno == EOPNOTSUPP)
+        *polled = 1;
+    format = NRF24_READ_RAW;
+    ioctl(fd, NRF24_SET_READ_FORMAT, &format);
+
+    return fd;
+}
+
+/* One packet into buf, 0 on timeout. A polled radio has no readiness to wait for,
+   its read() carries the driver's own deadline. */
+static int recv_packet(int fd, int polled, uint8_t *buf, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    ssize_t rd;
+    int ret;
+
+    for (;;)
+    {
+        if (!polled)
+        {
+            ret = poll(&pfd, 1, timeout_ms);
+            if (ret < 0 && errno != EINTR)
+                return -1;
+            if (ret == 0)
+                return 0;
+            if (ret < 0)
+                continue;
+        }
+
+        rd = read(fd, buf, PAYLOAD_SIZE);
+        if (rd > 0)
+            return rd;
+        if (rd < 0 && errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR)
+            return -1;
+        if (now_ns() >= deadline)
+            return 0;
+    }
+}
+
+static int send_packet(int fd, const uint8_t *buf, int size)
+{
+    if (write(fd, buf, size) != size)
+    {
+        perror("write payload");
+        return -1;
+    }
+    return 0;
+}
+
+static void sleep_until(uint64_t t_ns)
+{
+    struct timespec ts = { .tv_sec = t_ns / 1000000000ull, .tv_nsec = t_ns % 1000000000ull };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_echo(int fd, int polled, const struct options *opt)
+{
+    uint8_t buf[PAYLOAD_SIZE];
+    long echoed = 0;
+    int len;
+
+    /* Ends once the pinger has been quiet for a while, or never without a count. */
+    while (!opt->count || echoed < opt->count)
+    {
+        len = recv_packet(fd, polled, buf, opt->count ? opt->timeout_ms * 10 : 1000);
+        if (len < 0)
+            return 1;
+        if (len == 0)
+        {
+            if (opt->count)
+                break;
+            continue;
+        }
+        if (send_packet(fd, buf, len))
+            return 1;
+        echoed++;
+    }
+
+    if (opt->dev_b == NULL)
+        printf("echoed %ld packets\n", echoed);
+    return 0;
+}
+
+static int run_sink(int fd, int polled, const struct options *opt, struct sink_result *res)
+{
+    uint8_t buf[PAYLOAD_SIZE];
+    uint8_t *seen;
+    uint64_t t, sent;
+    uint32_t seq;
+    int len, timeout = 5000; /* The first packet may take a while. */
+
+    memset(res, 0, sizeof(*res));
+    res->lat_min_ns = UINT64_MAX;
+    seen = calloc(opt->count ? opt->count : 1, 1);
+    if (!seen)
+        return 1;
+
+    for (;;)
+    {
+        len = recv_packet(fd, polled, buf, timeout);
+        if (len < 0)
+        {
+            free(seen);
+            return 1;
+        }
+        if (len == 0)
+            break;
+
+        t = now_ns();
+        if (len < HDR_SIZE)
+            continue;
+        seq  = get_le(buf, 4);
+        sent = get_le(buf + 4, 8);
+
+        if (opt->count && seq < opt->count)
+        {
+            if (seen[seq]++)
+            {
+                res->duplicates++;
+                continue;
+            }
+        }
+        if (res->received && seq < res->max_seq)
+            res->reordered++;
+        if (seq > res->max_seq)
+            res->max_seq = seq;
+
+        if (!res->received++)
+            res->first_ns = sent;
+        res->last_ns = t;
+        if (t > sent)
+        {
+            res->lat_sum_ns += t - sent;
+            if (t - sent < res->lat_min_ns)
+                res->lat_min_ns = t - sent;
+            if (t - sent > res->lat_max_ns)
+                res->lat_max_ns = t - sent;
+        }
+
+        timeout = opt->timeout_ms;
+        if (opt->count && res->received == opt->count)
+            break;
+    }
+
+    free(seen);
+    return 0;
+}
+
+static int run_ping(int fd, int polled, const struct options *opt)
+{
+    uint8_t tx[PAYLOAD_SIZE], rx[PAYLOAD_SIZE];
+    uint64_t *rtt, start, t0, next;
+    long received = 0;
+    int len;
+
+    rtt = calloc(opt->count, sizeof(*rtt));
+    if (!rtt)
+        return 1;
+
+    start = next = now_ns();
+    for (long i = 0; i < opt->count; i++)
+    {
+        fill_packet(tx, opt->size, i);
+        t0 = get_le(tx + 4, 8);
+        if (send_packet(fd, tx, opt->size))
+            break;
+
+        /* Late echoes of earlier packets are skipped, they were counted lost. */
+        for (;;)
+        {
+            len = recv_packet(fd, polled, rx, opt->timeout_ms);
+            if (len <= 0)
+                break;
+            if (len >= HDR_SIZE && get_le(rx, 4) == (uint64_t)i)
+            {
+                rtt[received++] = now_ns() - t0;
+                break;
+            }
+        }
+        if (len < 0)
+            break;
+
+        next += opt->interval_us * 1000ull;
+        if (opt->interval_us)
+            sleep_until(next);
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    double loss = 100.0 * (opt->count - received) / opt->count;
+    qsort(rtt, received, sizeof(*rtt), cmp_u64);
+
+#define RTT_US(q) (received ? rtt[(long)((received - 1) * (q))] / 1000.0 : 0.0)
+    if (opt->json)
+        printf("{\"mode\":\"ping\",\"size\":%d,\"count\":%ld,\"received\":%ld,\"loss_pct\":%.3f,"
+               "\"seconds\":%.3f,\"rtt_us\":{\"min\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+               opt->size, opt->count, received, loss, secs,
+               RTT_US(0), RTT_US(0.5), RTT_US(0.99), RTT_US(1));
+    else
+        printf("ping: %ld/%ld echoed, %.2f%% lost, %.3f s\n"
+               "rtt us: min %.1f  p50 %.1f  p99 %.1f  max %.1f\n",
+               received, opt->count, loss, secs,
+               RTT_US(0), RTT_US(0.5), RTT_US(0.99), RTT_US(1));
+#undef RTT_US
+
+    free(rtt);
+    return 0;
+}
+
+static int run_flood(int fd, const struct options *opt, double *secs)
+{
+    uint8_t tx[PAYLOAD_SIZE];
+    uint64_t start, next;
+    long i;
+
+    start = next = now_ns();
+    for (i = 0; i < opt->count; i++)
+    {
+        fill_packet(tx, opt->size, i);
+        if (send_packet(fd, tx, opt->size))
+            break;
+
+        next += opt->interval_us * 1000ull;
+        if (opt->interval_us)
+            sleep_until(next);
+    }
+    *secs = (now_ns() - start) / 1e9;
+
+    return i == opt->count ? 0 : 1;
+}
+
+static void print_flood(const struct options *opt, long sent, double tx_secs, const struct sink_result *res)
+{
+    double rx_secs = res->received > 1 ? (res->last_ns - res->first_ns) / 1e9 : 0;
+    double pps = rx_secs > 0 ? res->received / rx_secs : 0;
+    double goodput = pps * (opt->size - HDR_SIZE) * 8 / 1000; /* kbit/s of payload past the header */
+    double loss = sent ? 100.0 * (sent - res->received) / sent : 0;
+    double lat_avg = res->received ? res->lat_sum_ns / 1000.0 / res->received : 0;
+    double lat_min = res->received ? res->lat_min_ns / 1000.0 : 0;
+
+    if (opt->json)
+        printf("{\"mode\":\"flood\",\"size\":%d,\"sent\":%ld,\"received\":%ld,\"duplicates\":%ld,"
+               "\"reordered\":%ld,\"loss_pct\":%.3f,\"tx_pps\":%.1f,\"rx_pps\":%.1f,\"goodput_kbps\":%.1f,"
+               "\"latency_us\":{\"min\":%.1f,\"avg\":%.1f,\"max\":%.1f}}\n",
+               opt->size, sent, res->received, res->duplicates, res->reordered, loss,
+               tx_secs > 0 ? sent / tx_secs : 0, pps, goodput,
+               lat_min, lat_avg, res->lat_max_ns / 1000.0);
+    else
+        printf("flood: %ld sent, %ld received, %.2f%% lost, %ld dup, %ld reordered\n"
+               "tx %.1f pkt/s, rx %.1f pkt/s, goodput %.1f kbit/s\n"
+               "latency us: min %.1f  avg %.1f  max %.1f\n",
+               sent, res->received, loss, res->duplicates, res->reordered,
+               tx_secs > 0 ? sent / tx_secs : 0, pps, goodput,
+               lat_min, lat_avg, res->lat_max_ns / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m ping|flood|echo|sink  mode, default ping\n"
+            "  -a DEV     radio of this side, default /dev/nrf24-0\n"
+            "  -b DEV     peer radio on this host, runs echo/sink in a child\n"
+            "  -A GPIO    CE of -a, default 591\n"
+            "  -B GPIO    CE of -b, default 592\n"
+            "  -s BYTES   payload size %d..%d, default %d\n"
+            "  -n COUNT   packets, default 1000 (0 = forever for echo)\n"
+            "  -i US      interval between packets, default 0\n"
+            "  -t MS      echo timeout of ping, idle end of sink, default 100\n"
+            "  -N         skip configuration, for radios already set up or emulated\n"
+            "  -j         one JSON object per run on stdout\n",
+            prog, HDR_SIZE, PAYLOAD_SIZE, PAYLOAD_SIZE);
+}
+
+static int parse_options(int argc, char **argv, struct options *opt)
+{
+    int c;
+
+    *opt = (struct options)
+    {
+        .mode       = MODE_PING,
+        .dev_a      = "/dev/nrf24-0",
+        .gpio_a     = 591, /* GPIO20 on raspberry pi */
+        .gpio_b     = 592, /* GPIO21 on raspberry pi */
+        .size       = PAYLOAD_SIZE,
+        .count      = 1000,
+        .timeout_ms = 100,
+    };
+
+    while ((c = getopt(argc, argv, "m:a:b:A:B:s:n:i:t:Njh")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            if (!strcmp(optarg, "ping"))
+                opt->mode = MODE_PING;
+            else if (!strcmp(optarg, "flood"))
+                opt->mode = MODE_FLOOD;
+            else if (!strcmp(optarg, "echo"))
+                opt->mode = MODE_ECHO;
+            else if (!strcmp(optarg, "sink"))
+                opt->mode = MODE_SINK;
+            else
+                return -1;
+            break;
+        case 'a': opt->dev_a = optarg; break;
+        case 'b': opt->dev_b = optarg; break;
+        case 'A': opt->gpio_a = strtoull(optarg, NULL, 0); break;
+        case 'B': opt->gpio_b = strtoull(optarg, NULL, 0); break;
+        case 's': opt->size = atoi(optarg); break;
+        case 'n': opt->count = atol(optarg); break;
+        case 'i': opt->interval_us = atol(optarg); break;
+        case 't': opt->timeout_ms = atoi(optarg); break;
+        case 'N': opt->no_init = 1; break;
+        case 'j': opt->json = 1; break;
+        default:
+            return -1;
+        }
+    }
+
+    if (opt->size < HDR_SIZE || opt->size > PAYLOAD_SIZE || opt->count < 0 ||
+        opt->interval_us < 0 || opt->timeout_ms <= 0)
+        return -1;
+
+    /* Senders need a count, their peer in a child is told the same. */
+    if ((opt->mode == MODE_PING || opt->mode == MODE_FLOOD) && !opt->count)
+        return -1;
+    if (opt->dev_b && (opt->mode == MODE_ECHO || opt->mode == MODE_SINK))
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt;
+    struct sink_result res;
+    int fd_a, fd_b = -1, polled_a, polled_b = 0;
+    int res_pipe[2] = { -1, -1 };
+    pid_t child = -1;
+    double secs = 0;
+    int ret = 1;
+
+    if (parse_options(argc, argv, &opt))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    fd_a = setup_radio(opt.dev_a, opt.gpio_a, 1, &opt, &polled_a);
+    if (fd_a < 0)
+        return 1;
+
+    if (opt.dev_b)
+    {
+        fd_b = setup_radio(opt.dev_b, opt.gpio_b, 0, &opt, &polled_b);
+        if (fd_b < 0 || pipe(res_pipe) < 0)
+            goto cleanup;
+
+        /* The peer listens before the first packet goes out. */
+        child = fork();
+        if (child < 0)
+        {
+            perror("fork");
+            goto cleanup;
+        }
+        if (child == 0)
+        {
+            close(fd_a);
+            close(res_pipe[0]);
+            if (opt.mode == MODE_PING)
+                ret = run_echo(fd_b, polled_b, &opt);
+            else
+            {
+                ret = run_sink(fd_b, polled_b, &opt, &res);
+                if (!ret && write(res_pipe[1], &res, sizeof(res)) != sizeof(res))
+                    ret = 1;
+            }
+            _exit(ret);
+        }
+        close(res_pipe[1]);
+        res_pipe[1] = -1;
+        usleep(10000);
+    }
+
+    switch (opt.mode)
+    {
+    case MODE_PING:
+        ret = run_ping(fd_a, polled_a, &opt);
+        break;
+    case MODE_ECHO:
+        ret = run_echo(fd_a, polled_a, &opt);
+        break;
+    case MODE_SINK:
+        ret = run_sink(fd_a, polled_a, &opt, &res);
+        /* Without a count the highest sequence number tells what was sent. */
+        if (!ret)
+            print_flood(&opt, opt.count ? opt.count : res.received ? res.max_seq + 1 : 0, 0, &res);
+        break;
+    case MODE_FLOOD:
+        ret = run_flood(fd_a, &opt, &secs);
+        if (child < 0)
+        {
+            /* Remote sink prints the receive side. */
+            printf(opt.json ? "{\"mode\":\"flood\",\"size\":%d,\"sent\":%ld,\"tx_pps\":%.1f}\n"
+                            : "flood: %d byte packets, %ld sent, %.1f pkt/s\n",
+                   opt.size, opt.count, secs > 0 ? opt.count / secs : 0);
+            break;
+        }
+        if (read(res_pipe[0], &res, sizeof(res)) != sizeof(res))
+        {
+            fprintf(stderr, "sink failed\n");
+            ret = 1;
+            break;
+        }
+        print_flood(&opt, opt.count, secs, &res);
+        break;
+    }
+
+cleanup:
+    if (child > 0)
+    {
+        if (ret)
+            kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+    }
+    if (res_pipe[0] >= 0)
+        close(res_pipe[0]);
+    if (res_pipe[1] >= 0)
+        close(res_pipe[1]);
+    if (fd_b >= 0)
+        close(fd_b);
+    close(fd_a);
+    return ret;
+}
@@ -0,0 +1,655 @@
+// SPDX-License-Identifier: GPL-2.0
+/* KUnit suite of the nrf24 driver, built into the module with "make KUNIT=1".
+   A register level model of the chip sits behind a mock SPI controller, so the
+   SPI command path runs as on hardware and every transaction on the bus is
+   counted. Included at the end of nrf24.c, it sees the static functions. */
+
+#include <kunit/test.h>
+#include <linux/uio.h>
+
+#define NRF24_EMU_FIFO 3
+#define NRF24_EMU_AIR 16          /* Packets sent on air, kept for the checks */
+#define NRF24_EMU_LOG 32          /* Messages, kept for the checks */
+#define NRF24_EMU_TICK_US 50      /* Air time of one packet */
+#define NRF24_EMU_SETTLE_US 130   /* Standby to TX/RX, CE high at least this long */
+#define NRF24_KUNIT_TIMEOUT_MS 500
+
+struct nrf24_emu_msg
+{
+    unsigned int transfers;
+    unsigned int bytes;
+};
+
+/* Fake nRF24L01+: registers, both FIFOs, the IRQ flags and CE. */
+struct nrf24_emu
+{
+    spinlock_t lock;
+    struct nrf24 *nrf24;  /* Owner of the CE pin and of the IRQ handler */
+    struct hrtimer tick;
+
+    u8 regs[0x20][5];
+    u8 flags;             /* RX_DR, TX_DS, MAX_RT */
+    struct nrf24_packet rx[NRF24_EMU_FIFO];
+    u8 rx_pipe[NRF24_EMU_FIFO];
+    unsigned int rx_count;
+    struct nrf24_packet tx[NRF24_EMU_FIFO];
+    unsigned int tx_count;
+    ktime_t ce_since;     /* 0 while CE is low */
+    bool rx_ready;        /* PRX, CE high and settled */
+
+    /* Command being clocked in, CS low. */
+    u8 cmd;
+    unsigned int pos;
+    u8 wbuf[NRF24_MAX_PAYLOAD];
+
+    struct nrf24_packet air[NRF24_EMU_AIR];
+    unsigned int air_count;
+
+    /* Bus counters, reset by nrf24_emu_reset_counters(). */
+    struct nrf24_emu_msg log[NRF24_EMU_LOG];
+    unsigned int messages;
+    unsigned int bytes;
+    unsigned int nops;
+    unsigned int status_reads; /* R_REGISTER of STATUS, it comes with every command */
+    unsigned int tx_payloads;
+    unsigned int rx_payloads;
+};
+
+struct nrf24_kunit
+{
+    struct device *parent;
+    struct spi_controller *ctlr;
+    struct spi_device *spi;
+    struct nrf24_emu *emu;
+    struct nrf24 *nrf24;
+};
+
+/* emu->lock held. */
+static u8 nrf24_emu_status(struct nrf24_emu *emu)
+{
+    u8 status = emu->flags;
+
+    status |= emu->rx_count ? emu->rx_pipe[0] << 1 : STATUS_RX_P_NO;
+    if (emu->tx_count == NRF24_EMU_FIFO)
+        status |= STATUS_TX_FULL;
+    return status;
+}
+
+/* emu->lock held. Sets flags, true if the IRQ line went low. */
+static bool nrf24_emu_raise(struct nrf24_emu *emu, u8 flags)
+{
+    u8 mask = ~emu->regs[REG_CONFIG][0] & (STATUS_RX_DR | STATUS_TX_DS | STATUS_MAX_RT);
+    bool was = emu->flags & mask;
+
+    emu->flags |= flags;
+    return !was && (emu->flags & mask);
+}
+
+/* emu->lock held. One byte on MOSI, the byte on MISO is returned. */
+static u8 nrf24_emu_byte(struct nrf24_emu *emu, u8 in)
+{
+    unsigned int idx;
+    u8 reg;
+
+    if (!emu->pos++)
+    {
+        emu->cmd = in;
+        if (in == NOP)
+            emu->nops++;
+        else if (in == (R_REGISTER | REG_STATUS))
+            emu->status_reads++;
+        return nrf24_emu_status(emu);
+    }
+
+    idx = emu->pos - 2;
+    reg = emu->cmd & 0x1F;
+
+    if ((emu->cmd & 0xE0) == R_REGISTER)
+    {
+        if (reg == REG_STATUS)
+            return nrf24_emu_status(emu);
+        if (reg == REG_FIFO_STATUS)
+            return (emu->rx_count ? 0 : FIFO_STATUS_RX_EMPTY) |
+                   (emu->rx_count == NRF24_EMU_FIFO ? BIT(1) : 0) |
+                   (emu->tx_count ? 0 : FIFO_STATUS_TX_EMPTY) |
+                   (emu->tx_count == NRF24_EMU_FIFO ? FIFO_STATUS_TX_FULL : 0);
+        return idx < 5 ? emu->regs[reg][idx] : 0;
+    }
+
+    if ((emu->cmd & 0xE0) == W_REGISTER || emu->cmd == W_TX_PAYLOAD ||
+        emu->cmd == W_TX_PAYLOAD_NOACK || (emu->cmd & 0xF8) == W_ACK_PAYLOAD)
+    {
+        if (idx < sizeof(emu->wbuf))
+            emu->wbuf[idx] = in;
+        return 0;
+    }
+
+    if (emu->cmd == R_RX_PL_WID)
+        return emu->rx_count ? emu->rx[0].len : 0;
+
+    if (emu->cmd == R_RX_PAYLOAD)
+        return emu->rx_count && idx < emu->rx[0].len ? emu->rx[0].data[idx] : 0;
+
+    return 0;
+}
+
+/* emu->lock held. CS went high, the command takes effect. */
+static void nrf24_emu_end(struct nrf24_emu *emu)
+{
+    unsigned int len = emu->pos ? emu->pos - 1 : 0;
+    u8 reg = emu->cmd & 0x1F;
+
+    if (!emu->pos)
+        return;
+    emu->pos = 0;
+
+    if ((emu->cmd & 0xE0) == W_REGISTER)
+    {
+        if (reg == REG_STATUS)
+            emu->flags &= ~(emu->wbuf[0] & (STATUS_RX_DR | STATUS_TX_DS | STATUS_MAX_RT));
+        else
+            memcpy(emu->regs[reg], emu->wbuf, min_t(unsigned int, len, 5));
+        return;
+    }
+
+    switch (emu->cmd)
+    {
+    case W_TX_PAYLOAD:
+    case W_TX_PAYLOAD_NOACK:
+        emu->tx_payloads++;
+        if (emu->tx_count == NRF24_EMU_FIFO || !len || len > NRF24_MAX_PAYLOAD)
+            break;
+        emu->tx[emu->tx_count].len = len;
+        memcpy(emu->tx[emu->tx_count].data, emu->wbuf, len);
+        emu->tx_count++;
+        break;
+    case R_RX_PAYLOAD:
+        emu->rx_payloads++;
+        if (!emu->rx_count || !len)
+            break;
+        emu->rx_count--;
+        memmove(&emu->rx[0], &emu->rx[1], emu->rx_count * sizeof(emu->rx[0]));
+        memmove(&emu->rx_pipe[0], &emu->rx_pipe[1], emu->rx_count);
+        break;
+    case FLUSH_TX:
+        emu->tx_count = 0;
+        break;
+    case FLUSH_RX:
+        emu->rx_count = 0;
+        break;
+    }
+}
+
+static int nrf24_emu_transfer_one_message(struct spi_controller *ctlr, struct spi_message *msg)
+{
+    struct nrf24_emu *emu = spi_controller_get_devdata(ctlr);
+    struct spi_transfer *xfer;
+    unsigned long flags;
+    unsigned int i, transfers = 0, bytes = 0;
+    const u8 *tx;
+    u8 *rx, out;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    list_for_each_entry(xfer, &msg->transfers, transfer_list)
+    {
+        tx = xfer->tx_buf;
+        rx = xfer->rx_buf;
+        for (i = 0; i < xfer->len; i++)
+        {
+            out = nrf24_emu_byte(emu, tx ? tx[i] : 0);
+            if (rx)
+                rx[i] = out;
+        }
+
+        transfers++;
+        bytes += xfer->len;
+        msg->actual_length += xfer->len;
+
+        /* cs_change on the last transfer keeps CS low, on the others it pulses it. */
+        if (xfer->cs_change && !list_is_last(&xfer->transfer_list, &msg->transfers))
+            nrf24_emu_end(emu);
+    }
+    nrf24_emu_end(emu);
+
+    if (emu->messages < NRF24_EMU_LOG)
+    {
+        emu->log[emu->messages].transfers = transfers;
+        emu->log[emu->messages].bytes = bytes;
+    }
+    emu->messages++;
+    emu->bytes += bytes;
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    msg->status = 0;
+    spi_finalize_current_message(ctlr);
+    return 0;
+}
+
+/* Air side: CE timing, one TX packet per tick, TX_DS for every packet sent. */
+static enum hrtimer_restart nrf24_emu_tick(struct hrtimer *timer)
+{
+    struct nrf24_emu *emu = container_of(timer, struct nrf24_emu, tick);
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    bool settled, irq = false;
+    u8 cfg;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    if (!READ_ONCE(emu->nrf24->ce))
+        emu->ce_since = 0;
+    else if (!emu->ce_since)
+        emu->ce_since = now;
+
+    cfg = emu->regs[REG_CONFIG][0];
+    settled = emu->ce_since && (cfg & CONFIG_PWR_UP) &&
+              ktime_us_delta(now, emu->ce_since) >= NRF24_EMU_SETTLE_US;
+    emu->rx_ready = settled && (cfg & CONFIG_PRIM_RX);
+
+    if (settled && !(cfg & CONFIG_PRIM_RX) && emu->tx_count)
+    {
+        if (emu->air_count < NRF24_EMU_AIR)
+            emu->air[emu->air_count++] = emu->tx[0];
+        emu->tx_count--;
+        memmove(&emu->tx[0], &emu->tx[1], emu->tx_count * sizeof(emu->tx[0]));
+        irq = nrf24_emu_raise(emu, STATUS_TX_DS);
+    }
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    if (irq)
+        nrf24_irq(0, emu->nrf24);
+
+    hrtimer_forward_now(timer, us_to_ktime(NRF24_EMU_TICK_US));
+    return HRTIMER_RESTART;
+}
+
+/* A packet for the RX FIFO, false if the radio isn't listening or the FIFO is full. */
+static bool nrf24_emu_inject(struct nrf24_emu *emu, u8 pipe, const u8 *data, u8 len)
+{
+    unsigned long flags;
+    bool irq;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    if (!emu->rx_ready || emu->rx_count == NRF24_EMU_FIFO)
+    {
+        spin_unlock_irqrestore(&emu->lock, flags);
+        return false;
+    }
+    emu->rx[emu->rx_count].len = len;
+    memcpy(emu->rx[emu->rx_count].data, data, len);
+    emu->rx_pipe[emu->rx_count] = pipe;
+    emu->rx_count++;
+    irq = nrf24_emu_raise(emu, STATUS_RX_DR);
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    if (irq)
+        nrf24_irq(0, emu->nrf24);
+    return true;
+}
+
+static void nrf24_emu_reset_counters(struct nrf24_emu *emu)
+{
+    spin_lock_irq(&emu->lock);
+    memset(emu->log, 0, sizeof(emu->log));
+    emu->messages = 0;
+    emu->bytes = 0;
+    emu->nops = 0;
+    emu->status_reads = 0;
+    emu->tx_payloads = 0;
+    emu->rx_payloads = 0;
+    emu->air_count = 0;
+    spin_unlock_irq(&emu->lock);
+}
+
+#define nrf24_kunit_wait_for(cond)                                                  \
+({                                                                                  \
+    unsigned long __end = jiffies + msecs_to_jiffies(NRF24_KUNIT_TIMEOUT_MS);       \
+    while (!(cond) && time_before(jiffies, __end))                                  \
+        usleep_range(100, 200);                                                     \
+    (cond);                                                                         \
+})
+
+/* Engine out of steps and the radio back in PRX. */
+static bool nrf24_kunit_settled(struct nrf24 *nrf24)
+{
+    bool settled;
+
+    spin_lock_irq(&nrf24->engine_lock);
+    settled = !nrf24->engine_busy && !nrf24->status_stale && !nrf24->clear_flags &&
+              !nrf24->rx_more && !nrf24->rx_flush && !nrf24->tx_active &&
+              nrf24->rx_mode && kfifo_is_empty(&nrf24->tx_fifo);
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    return settled;
+}
+
+static bool nrf24_kunit_rx_ready(struct nrf24_emu *emu)
+{
+    bool ready;
+
+    spin_lock_irq(&emu->lock);
+    ready = emu->rx_ready;
+    spin_unlock_irq(&emu->lock);
+
+    return ready;
+}
+
+static const u8 nrf24_kunit_tx_address[5] = { 0xE7, 0xE7, 0xE7, 0xE7, 0xE7 };
+static const u8 nrf24_kunit_rx_address[5] = { 0xC2, 0xC2, 0xC2, 0xC2, 0xC2 };
+
+/* Fixed 32 byte payloads on pipe 0, no ESB, IRQ line from the emulator. */
+static int nrf24_kunit_configure(struct nrf24_kunit *ctx)
+{
+    struct nrf24 *nrf24 = ctx->nrf24;
+    int ret;
+
+    memcpy(nrf24->config.tx_address, nrf24_kunit_tx_address, 5);
+    memcpy(nrf24->config.rx_address, nrf24_kunit_rx_address, 5);
+
+    ret = nrf24_reconfigure(nrf24);
+    if (ret)
+        return ret;
+
+    if (!nrf24_kunit_wait_for(nrf24_kunit_settled(nrf24) && nrf24_kunit_rx_ready(ctx->emu)))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+static int nrf24_kunit_init(struct kunit *test)
+{
+    struct spi_board_info info =
+    {
+        .modalias     = "nrf24-emu",
+        .max_speed_hz = NRF24_SPI_MAX_HZ,
+        .mode         = SPI_MODE_0,
+    };
+    struct nrf24_kunit *ctx;
+    int ret;
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    test->priv = ctx;
+
+    ctx->parent = root_device_register("nrf24-kunit");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(ctx->parent));
+
+    ctx->ctlr = spi_alloc_host(ctx->parent, sizeof(struct nrf24_emu));
+    KUNIT_ASSERT_NOT_NULL(test, ctx->ctlr);
+    ctx->ctlr->bus_num = -1;
+    ctx->ctlr->num_chipselect = 1;
+    ctx->ctlr->mode_bits = SPI_MODE_0;
+    ctx->ctlr->transfer_one_message = nrf24_emu_transfer_one_message;
+
+    ctx->emu = spi_controller_get_devdata(ctx->ctlr);
+    spin_lock_init(&ctx->emu->lock);
+
+    ret = spi_register_controller(ctx->ctlr);
+    KUNIT_ASSERT_EQ(test, ret, 0);
+
+    ctx->spi = spi_new_device(ctx->ctlr, &info);
+    KUNIT_ASSERT_NOT_NULL(test, ctx->spi);
+
+    /* Like probe(), without the device nodes. CE has no gpio, the emulator reads nrf24->ce. */
+    ctx->nrf24 = kunit_kzalloc(test, sizeof(*ctx->nrf24), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx->nrf24);
+    nrf24_init_state(ctx->nrf24, ctx->spi);
+    ctx->nrf24->irq = 1;
+    ctx->nrf24->rf.spi_hz = NRF24_SPI_MAX_HZ;
+    ctx->nrf24->rf.data_rate_kbps = 1000;
+    ctx->nrf24->rf.channel = 76;
+    ctx->nrf24->rf.pa_dbm = 0;
+
+    ctx->emu->nrf24 = ctx->nrf24;
+    hrtimer_init(&ctx->emu->tick, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctx->emu->tick.function = nrf24_emu_tick;
+    hrtimer_start(&ctx->emu->tick, us_to_ktime(NRF24_EMU_TICK_US), HRTIMER_MODE_REL);
+
+    return 0;
+}
+
+static void nrf24_kunit_exit(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+
+    if (!ctx)
+        return;
+
+    /* Like remove(), the engine stays quiesced. */
+    if (ctx->emu && ctx->emu->nrf24)
+    {
+        nrf24_tx_cancel(ctx->nrf24);
+        nrf24_lock(ctx->nrf24);
+        hrtimer_cancel(&ctx->nrf24->tx_timer);
+        hrtimer_cancel(&ctx->nrf24->poll_timer);
+        hrtimer_cancel(&ctx->nrf24->sched_timer);
+        hrtimer_cancel(&ctx->nrf24->retry_timer);
+        hrtimer_cancel(&ctx->nrf24->rx_wake_timer);
+        mutex_unlock(&ctx->nrf24->lock);
+        hrtimer_cancel(&ctx->emu->tick);
+    }
+
+    if (ctx->spi)
+        spi_unregister_device(ctx->spi);
+    if (ctx->ctlr)
+        spi_unregister_controller(ctx->ctlr);
+    if (!IS_ERR_OR_NULL(ctx->parent))
+        root_device_unregister(ctx->parent);
+}
+
+/* The whole configuration is one message of one transfer per register, then STATUS and PRX. */
+static void nrf24_kunit_init_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24_emu *emu = ctx->emu;
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+
+    /* RX_ADDR_P0, EN_RXADDR, TX_ADDR, EN_AA, SETUP_RETR, SETUP_AW, RX_PW_P0..5,
+       RF_CH, RF_SETUP, FEATURE, DYNPD, CONFIG. */
+    KUNIT_EXPECT_EQ(test, ctx->nrf24->stats.spi_sync, 1);
+    KUNIT_EXPECT_EQ(test, emu->log[0].transfers, 17);
+    KUNIT_EXPECT_EQ(test, emu->log[0].bytes, 42);
+
+    /* NOP for STATUS, CONFIG with PRIM_RX. */
+    KUNIT_EXPECT_EQ(test, emu->messages, 3);
+    KUNIT_EXPECT_EQ(test, emu->bytes, 45);
+    KUNIT_EXPECT_EQ(test, emu->status_reads, 0);
+
+    KUNIT_EXPECT_EQ(test, emu->regs[REG_CONFIG][0], CONFIG_PWR_UP | CONFIG_PRIM_RX);
+    KUNIT_EXPECT_EQ(test, emu->regs[REG_RF_CH][0], 76);
+    KUNIT_EXPECT_EQ(test, emu->regs[REG_RX_PW_P0][0], NRF24_MAX_PAYLOAD);
+    KUNIT_EXPECT_MEMEQ(test, emu->regs[REG_TX_ADDR], nrf24_kunit_tx_address, 5);
+    KUNIT_EXPECT_MEMEQ(test, emu->regs[REG_RX_ADDR_P0], nrf24_kunit_rx_address, 5);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(ctx->nrf24->ce), 1);
+}
+
+/* Nothing changed, the shadow leaves only the PTX/PRX flip of CONFIG on the bus. */
+static void nrf24_kunit_reconfigure_cached_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24_emu *emu = ctx->emu;
+    u64 sync;
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+    nrf24_emu_reset_counters(emu);
+    sync = ctx->nrf24->stats.spi_sync;
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+
+    KUNIT_EXPECT_EQ(test, ctx->nrf24->stats.spi_sync - sync, 1);
+    KUNIT_EXPECT_EQ(test, emu->log[0].transfers, 1);
+    KUNIT_EXPECT_EQ(test, emu->log[0].bytes, 2);
+    KUNIT_EXPECT_EQ(test, emu->messages, 3);
+}
+
+/* IRQ, NOP, clear RX_DR, payload, NOP that finds the FIFO empty. */
+static void nrf24_kunit_receive_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24 *nrf24 = ctx->nrf24;
+    struct nrf24_emu *emu = ctx->emu;
+    struct nrf24_packet pkt;
+    u8 data[NRF24_MAX_PAYLOAD];
+    ktime_t start;
+    int i;
+
+    for (i = 0; i < NRF24_MAX_PAYLOAD; i++)
+        data[i] = i ^ 0x5A;
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+    nrf24_emu_reset_counters(emu);
+
+    /* Stamped at the interrupt, not when read. */
+    start = ktime_get();
+    KUNIT_ASSERT_TRUE(test, nrf24_emu_inject(emu, 0, data, sizeof(data)));
+    KUNIT_ASSERT_TRUE(test, nrf24_kunit_wait_for(!kfifo_is_empty(&nrf24->pipes[0].rx_fifo) &&
+                                                 nrf24_kunit_settled(nrf24)));
+
+    KUNIT_ASSERT_TRUE(test, nrf24_rx_get(nrf24, ALL_PIPES, &pkt));
+    KUNIT_EXPECT_EQ(test, pkt.len, NRF24_MAX_PAYLOAD);
+    KUNIT_EXPECT_MEMEQ(test, pkt.data, data, sizeof(data));
+    KUNIT_EXPECT_EQ(test, pkt.pipe, 0);
+    KUNIT_EXPECT_EQ(test, pkt.flags, 0);
+    KUNIT_EXPECT_TRUE(test, ktime_compare(pkt.stamp, start) >= 0);
+    KUNIT_EXPECT_TRUE(test, ktime_compare(pkt.stamp, ktime_get()) <= 0);
+
+    KUNIT_EXPECT_EQ(test, emu->messages, 4);
+    KUNIT_EXPECT_EQ(test, emu->bytes, 1 + 2 + 1 + NRF24_MAX_PAYLOAD + 1);
+    KUNIT_EXPECT_EQ(test, emu->nops, 2);
+    KUNIT_EXPECT_EQ(test, emu->rx_payloads, 1);
+    KUNIT_EXPECT_EQ(test, emu->status_reads, 0);
+    KUNIT_EXPECT_EQ(test, emu->flags, 0);
+}
+
+/* A burst of a full TX FIFO: every payload is written once, in order, STATUS never read as a register. */
+static void nrf24_kunit_send_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24 *nrf24 = ctx->nrf24;
+    struct nrf24_emu *emu = ctx->emu;
+    struct nrf24_packet pkts[NRF24_TX_FIFO_DEPTH];
+    int i, j;
+
+    for (i = 0; i < NRF24_TX_FIFO_DEPTH; i++)
+    {
+        pkts[i].len = NRF24_MAX_PAYLOAD;
+        for (j = 0; j < NRF24_MAX_PAYLOAD; j++)
+            pkts[i].data[j] = i * NRF24_MAX_PAYLOAD + j;
+    }
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+    nrf24_emu_reset_counters(emu);
+
+    KUNIT_ASSERT_EQ(test, kfifo_in_spinlocked(&nrf24->tx_fifo, pkts, NRF24_TX_FIFO_DEPTH,
+                                              &nrf24->tx_lock), NRF24_TX_FIFO_DEPTH);
+    nrf24_engine_run(nrf24);
+
+    KUNIT_ASSERT_TRUE(test, nrf24_kunit_wait_for(READ_ONCE(emu->air_count) == NRF24_TX_FIFO_DEPTH &&
+                                                 nrf24_kunit_settled(nrf24)));
+
+    for (i = 0; i < NRF24_TX_FIFO_DEPTH; i++)
+    {
+        KUNIT_EXPECT_EQ(test, emu->air[i].len, NRF24_MAX_PAYLOAD);
+        KUNIT_EXPECT_MEMEQ(test, emu->air[i].data, pkts[i].data, NRF24_MAX_PAYLOAD);
+    }
+
+    KUNIT_EXPECT_EQ(test, emu->tx_payloads, NRF24_TX_FIFO_DEPTH);
+    KUNIT_EXPECT_EQ(test, emu->status_reads, 0);
+    KUNIT_EXPECT_EQ(test, nrf24->stats.tx_packets, NRF24_TX_FIFO_DEPTH);
+    KUNIT_EXPECT_EQ(test, nrf24->stats.tx_timeouts, 0);
+
+    /* Role switches, flush, clears and FIFO checks around three 33 byte writes.
+       The exact count depends on how TX_DS and the steps interleave. */
+    KUNIT_EXPECT_LE(test, emu->messages, 4 * NRF24_TX_FIFO_DEPTH + 8);
+    KUNIT_EXPECT_GE(test, emu->bytes, NRF24_TX_FIFO_DEPTH * (NRF24_MAX_PAYLOAD + 1));
+}
+
+/* Packets queued one by one within the coalescing delay go out in a single burst. */
+static void nrf24_kunit_coalesce_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24 *nrf24 = ctx->nrf24;
+    struct nrf24_emu *emu = ctx->emu;
+    struct nrf24_packet pkt = { .len = 8 };
+    int i;
+
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+    spin_lock_irq(&nrf24->engine_lock);
+    nrf24->sched.coalesce_us = 20000;
+    spin_unlock_irq(&nrf24->engine_lock);
+
+    for (i = 0; i < NRF24_TX_FIFO_DEPTH; i++)
+    {
+        pkt.data[0] = i;
+        KUNIT_ASSERT_EQ(test, kfifo_in_spinlocked(&nrf24->tx_fifo, &pkt, 1, &nrf24->tx_lock), 1);
+        nrf24_engine_run(nrf24);
+        if (i < NRF24_TX_FIFO_DEPTH - 1)
+            KUNIT_EXPECT_FALSE(test, READ_ONCE(nrf24->tx_active));
+    }
+
+    KUNIT_ASSERT_TRUE(test, nrf24_kunit_wait_for(READ_ONCE(emu->air_count) == NRF24_TX_FIFO_DEPTH &&
+                                                 nrf24_kunit_settled(nrf24)));
+
+    for (i = 0; i < NRF24_TX_FIFO_DEPTH; i++)
+        KUNIT_EXPECT_EQ(test, emu->air[i].data[0], i);
+    KUNIT_EXPECT_EQ(test, nrf24->stats.tx_bursts, 1);
+}
+
+/* writev()/io_uring: one packet per segment, short ones padded to the fixed width. */
+static void nrf24_kunit_write_iter_test(struct kunit *test)
+{
+    struct nrf24_kunit *ctx = test->priv;
+    struct nrf24 *nrf24 = ctx->nrf24;
+    struct nrf24_emu *emu = ctx->emu;
+    struct file file = { .private_data = nrf24 };
+    struct kiocb iocb = { .ki_filp = &file, .ki_flags = IOCB_NOWAIT };
+    u8 a[5] = { 1, 2, 3, 4, 5 }, b[NRF24_MAX_PAYLOAD], c[10];
+    struct kvec vec[] =
+    {
+        { .iov_base = a, .iov_len = sizeof(a) },
+        { .iov_base = NULL, .iov_len = 0 },
+        { .iov_base = b, .iov_len = sizeof(b) },
+        { .iov_base = c, .iov_len = sizeof(c) },
+    };
+    struct iov_iter iter;
+
+    memset(b, 0xb, sizeof(b));
+    memset(c, 0xc, sizeof(c));
+    KUNIT_ASSERT_EQ(test, nrf24_kunit_configure(ctx), 0);
+
+    iov_iter_kvec(&iter, ITER_SOURCE, vec, ARRAY_SIZE(vec), sizeof(a) + sizeof(b) + sizeof(c));
+    KUNIT_EXPECT_EQ(test, nrf24_write_iter(&iocb, &iter), sizeof(a) + sizeof(b) + sizeof(c));
+
+    KUNIT_ASSERT_TRUE(test, nrf24_kunit_wait_for(READ_ONCE(emu->air_count) == 3 &&
+                                                 nrf24_kunit_settled(nrf24)));
+    KUNIT_EXPECT_EQ(test, emu->air[0].len, NRF24_MAX_PAYLOAD);
+    KUNIT_EXPECT_MEMEQ(test, emu->air[0].data, a, sizeof(a));
+    KUNIT_EXPECT_EQ(test, emu->air[0].data[sizeof(a)], 0);
+    KUNIT_EXPECT_MEMEQ(test, emu->air[1].data, b, sizeof(b));
+    KUNIT_EXPECT_MEMEQ(test, emu->air[2].data, c, sizeof(c));
+
+    /* A segment longer than a payload is refused before anything is queued. */
+    vec[0].iov_len = NRF24_MAX_PAYLOAD + 1;
+    iov_iter_kvec(&iter, ITER_SOURCE, vec, 1, NRF24_MAX_PAYLOAD + 1);
+    KUNIT_EXPECT_EQ(test, nrf24_write_iter(&iocb, &iter), -EINVAL);
+}
+
+static struct kunit_case nrf24_kunit_cases[] =
+{
+    KUNIT_CASE(nrf24_kunit_init_test),
+    KUNIT_CASE(nrf24_kunit_reconfigure_cached_test),
+    KUNIT_CASE(nrf24_kunit_receive_test),
+    KUNIT_CASE(nrf24_kunit_send_test),
+    KUNIT_CASE(nrf24_kunit_coalesce_test),
+    KUNIT_CASE(nrf24_kunit_write_iter_test),
+    {}
+};
+
+static struct kunit_suite nrf24_kunit_suite =
+{
+    .name       = "nrf24",
+    .init       = nrf24_kunit_init,
+    .exit       = nrf24_kunit_exit,
+    .test_cases = nrf24_kunit_cases,
+};
+
+kunit_test_suite(nrf24_kunit_suite);
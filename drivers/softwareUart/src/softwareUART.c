@@ -9,8 +9,23 @@
 #include <linux/kernel.h>
 #include <linux/irq.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/err.h>
+#include <linux/string.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
 
 #define UART_CONFIG _IOW('U', 1, UARTConfig)
+#define UART_ADD_PORT _IOR('U', 2, int)    /* Creates /dev/softwareUART<n>, n is returned. */
+#define UART_REMOVE_PORT _IOW('U', 3, int) /* Removes /dev/softwareUART<n>, it must be closed. */
+#define CONTROL_NAME "softwareUART-ctl" /* Takes both of the above, no port needs to be opened. */
+#define UART_GET_STATS _IOR('U', 4, UARTStats)
+#define MAX_PORTS 8 /* Port 0 is /dev/softwareUART, always there. */
+#define RX_FIFO_SIZE 1024 /* Bytes, must be power of 2. */
+#define TX_FIFO_SIZE 1024 /* Bytes, must be power of 2. */
 
 /** @brief Configuration parameters for UART
  */
@@ -28,36 +43,78 @@ typedef struct
     char isInverted;
 } UARTConfig;
 
-UARTConfig uart_params;
-static struct hrtimer tx_hrtimer;
-static struct hrtimer rx_hrtimer;
-static char tx_buffer[256]; // Test size
-static int tx_buffer_pos = 0;
-static int tx_buffer_len = 0;
-static int tx_in_progress = 0;
-static int tx_bit_pos = 0;
+/** @brief Counters of a port since it was opened
+ */
+typedef struct
+{
+    unsigned long long rxBytes;
+    unsigned long long txBytes;
+    unsigned long long rxOverruns; // Received while the RX ring was full, dropped.
+} UARTStats;
 
+/** @brief State of one software UART, each has its own device node and pins.
+ */
+struct soft_uart
+{
+    struct miscdevice miscDevice;
+    char name[24];
+    int index;
+    int isOpen;
+    int isDying; // Being removed, open() must not take it anymore.
+    struct mutex lock; // Serialises configuration against open/close.
+    struct mutex read_lock;  // Single consumer of rx_fifo
+    struct mutex write_lock; // Single producer of tx_fifo, taken before lock.
+
+    UARTConfig uart_params;
+    int isInit;
+    int bit_duration;
+
+    // write() fills tx_fifo, the TX timer empties it. tx_lock orders the
+    // end of a transmission against a write() that wants to start one.
+    struct hrtimer tx_hrtimer;
+    DECLARE_KFIFO(tx_fifo, unsigned char, TX_FIFO_SIZE);
+    spinlock_t tx_lock;
+    wait_queue_head_t tx_wq;
+    int tx_in_progress;
+    int tx_bit_pos;
+    unsigned char tx_current_byte;
+
+    // The RX timer fills rx_fifo, read() empties it.
+    struct hrtimer rx_hrtimer;
+    int rx_gpio_irq;
+    DECLARE_KFIFO(rx_fifo, unsigned char, RX_FIFO_SIZE);
+    wait_queue_head_t rx_wq;
+    int rx_bit_pos;
+    unsigned char rx_current_byte;
+
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;
+    unsigned long rx_overruns;
+};
 
-static int rx_gpio_irq;
-static char rx_buffer[256]; // Test size
-static int rx_buffer_pos = 0;
-static int bit_duration = 0;
-static int rx_bit_pos = 0;
+static struct soft_uart *ports[MAX_PORTS];
+static DEFINE_MUTEX(ports_lock); // Protects ports[], isOpen and isDying.
 
 static enum hrtimer_restart tx_hrtimer_handler(struct hrtimer *timer);
 static enum hrtimer_restart rx_hrtimer_handler(struct hrtimer *timer);
 static irqreturn_t rx_irq_handler(int irq, void *dev_id);
 
-static int isInit = 0;
-
-int initPeripherals(UARTConfig *uart_params) 
+int initPeripherals(struct soft_uart *port) 
 {
+    UARTConfig *uart_params = &port->uart_params;
     int ret;
+
+    if (uart_params->baudRate <= 0 || uart_params->baudRate > 1000000)
+    {
+        pr_err("%s: Invalid baud rate %d\n", port->name, uart_params->baudRate);
+        return -EINVAL;
+    }
+
     // Initialize GPIOs based on the received parameters
     ret = gpio_request(uart_params->txPin, "GPIO_TX");
     if (ret) 
     {
-        pr_err("Failed to request GPIO_TX (pin %d), error: %d\n", uart_params->txPin, ret);
+        pr_err("%s: Failed to request GPIO_TX (pin %d), error: %d\n", port->name, uart_params->txPin, ret);
         return ret;
     }
     gpio_direction_output(uart_params->txPin, 1);
@@ -65,233 +122,528 @@ int initPeripherals(UARTConfig *uart_params)
     ret = gpio_request(uart_params->rxPin, "GPIO_RX");
     if (ret) 
     {
-        pr_err("Failed to request GPIO_RX (pin %d), error: %d\n", uart_params->rxPin, ret);
+        pr_err("%s: Failed to request GPIO_RX (pin %d), error: %d\n", port->name, uart_params->rxPin, ret);
         gpio_free(uart_params->txPin);
         return ret;
     }
 
     gpio_direction_input(uart_params->rxPin);
 
-    pr_info("Requested GPIOs - TX: %d, RX: %d\n", uart_params->txPin, uart_params->rxPin);
+    pr_info("%s: Requested GPIOs - TX: %d, RX: %d\n", port->name, uart_params->txPin, uart_params->rxPin);
 
     // Request IRQ for RX
-    rx_gpio_irq = gpio_to_irq(uart_params->rxPin);
-    if (rx_gpio_irq < 0) 
+    port->rx_gpio_irq = gpio_to_irq(uart_params->rxPin);
+    if (port->rx_gpio_irq < 0) 
     {
-        pr_err("Failed to map GPIO %d to IRQ: %d\n", uart_params->rxPin, rx_gpio_irq);
+        pr_err("%s: Failed to map GPIO %d to IRQ: %d\n", port->name, uart_params->rxPin, port->rx_gpio_irq);
         gpio_free(uart_params->txPin);
         gpio_free(uart_params->rxPin);
-        return ret;
+        return port->rx_gpio_irq;
     }
 
-    pr_info("Mapped GPIO %d to IRQ %d\n", uart_params->rxPin, rx_gpio_irq);
+    pr_info("%s: Mapped GPIO %d to IRQ %d\n", port->name, uart_params->rxPin, port->rx_gpio_irq);
+
+    // Calculate bit duration for rx timer interrupt for proper sampling.
+    // Timers must be ready before the first start bit can come in.
+    port->bit_duration = 1000000 / uart_params->baudRate;
+    port->rx_bit_pos = 0;
+    port->rx_current_byte = 0;
+    port->tx_in_progress = 0;
+
+    // Initialize high-resolution timers
+    hrtimer_init(&port->tx_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    port->tx_hrtimer.function = tx_hrtimer_handler;
+    
+    hrtimer_init(&port->rx_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    port->rx_hrtimer.function = rx_hrtimer_handler;
 
-    ret = request_irq(rx_gpio_irq, rx_irq_handler, IRQF_TRIGGER_FALLING, "soft_uart_rx", NULL);
+    ret = request_irq(port->rx_gpio_irq, rx_irq_handler, IRQF_TRIGGER_FALLING, port->name, port);
     if (ret) 
     {
-        pr_err("Failed to request IRQ %d for RX: %d\n", rx_gpio_irq, ret);
+        pr_err("%s: Failed to request IRQ %d for RX: %d\n", port->name, port->rx_gpio_irq, ret);
         gpio_free(uart_params->txPin);
         gpio_free(uart_params->rxPin);
         return ret;
     } 
     else 
     {
-        pr_info("Successfully requested IRQ %d for RX\n", rx_gpio_irq);
+        pr_info("%s: Successfully requested IRQ %d for RX\n", port->name, port->rx_gpio_irq);
     }
 
-    // Calculate bit duration for rx timer interrupt for proper sampling.
-    bit_duration = 1000000 / uart_params->baudRate;
-    isInit = 1;
+    port->isInit = 1;
 
-    // Initialize high-resolution timers
-    hrtimer_init(&tx_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    tx_hrtimer.function = tx_hrtimer_handler;
-    
-    hrtimer_init(&rx_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    rx_hrtimer.function = rx_hrtimer_handler;
-
-    pr_info("UART initialized successfully\n");
+    pr_info("%s: UART initialized successfully\n", port->name);
     return 0;
 }
 
+static void releasePeripherals(struct soft_uart *port)
+{
+    if (!port->isInit)
+        return;
+
+    free_irq(port->rx_gpio_irq, port);
+    hrtimer_cancel(&port->tx_hrtimer);
+    hrtimer_cancel(&port->rx_hrtimer);
+    gpio_free(port->uart_params.txPin);
+    gpio_free(port->uart_params.rxPin);
+    port->isInit = 0;
+
+    // Sleepers in read() and write() would wait for a ring that no timer moves.
+    wake_up_interruptible(&port->rx_wq);
+    wake_up_interruptible(&port->tx_wq);
+}
+
 static enum hrtimer_restart tx_hrtimer_handler(struct hrtimer *timer)
 {
-    static char current_byte;
+    struct soft_uart *port = container_of(timer, struct soft_uart, tx_hrtimer);
+    unsigned long flags;
 
-    if (tx_buffer_pos >= tx_buffer_len)
+    if (port->tx_bit_pos == 0)
     {
-        // No more data to send
-        tx_in_progress = 0;
-        return HRTIMER_NORESTART;
-    }
+        spin_lock_irqsave(&port->tx_lock, flags);
+        if (!kfifo_get(&port->tx_fifo, &port->tx_current_byte))
+        {
+            // No more data to send
+            port->tx_in_progress = 0;
+            spin_unlock_irqrestore(&port->tx_lock, flags);
+            wake_up_interruptible(&port->tx_wq);
+            return HRTIMER_NORESTART;
+        }
+        spin_unlock_irqrestore(&port->tx_lock, flags);
+        port->tx_bytes++;
+        wake_up_interruptible(&port->tx_wq);
 
-    if (tx_bit_pos == 0)
-    {
         // Start bit
-        gpio_set_value(uart_params.txPin, 0);
-        current_byte = tx_buffer[tx_buffer_pos];
+        gpio_set_value(port->uart_params.txPin, 0);
     }
-    else if (tx_bit_pos <= 8)
+    else if (port->tx_bit_pos <= 8)
     {
         // Data bit not inverted.
-        gpio_set_value(uart_params.txPin, (current_byte >> (tx_bit_pos - 1)) & 0x01);
+        gpio_set_value(port->uart_params.txPin, (port->tx_current_byte >> (port->tx_bit_pos - 1)) & 0x01);
     }
-    else if (tx_bit_pos == 9)
+    else if (port->tx_bit_pos == 9)
     {
-        gpio_set_value(uart_params.txPin, 1); // Stop bit
-        tx_bit_pos = -1; // Prepare for the next byte
-        tx_buffer_pos++;
-        if (tx_buffer_pos >= tx_buffer_len) 
-        {
-            tx_in_progress = 0;
-            return HRTIMER_NORESTART;
-        }
+        gpio_set_value(port->uart_params.txPin, 1); // Stop bit
+        port->tx_bit_pos = -1; // Prepare for the next byte, it waits for the end of the stop bit.
     }
 
-    tx_bit_pos++;
-    hrtimer_forward_now(&tx_hrtimer, ktime_set(0, bit_duration * 1000)); // bit_duration in microseconds to nanoseconds
+    port->tx_bit_pos++;
+    hrtimer_forward_now(timer, ktime_set(0, port->bit_duration * 1000)); // bit_duration in microseconds to nanoseconds
     return HRTIMER_RESTART;
 }
 
-static void start_tx(void)
+static void start_tx(struct soft_uart *port)
 {
-    if (tx_in_progress) 
-        return;
-    tx_in_progress = 1;
-    tx_buffer_pos = 0;
-    tx_bit_pos = 0;
-    // Ensure GPIO is in idle state (stop bit = 1)
-    gpio_set_value(uart_params.txPin, 1);
+    unsigned long flags;
 
-    if (tx_buffer_len > 0) 
+    // A running transmission picks up the new bytes, it only stops on an empty ring.
+    spin_lock_irqsave(&port->tx_lock, flags);
+    if (port->tx_in_progress || kfifo_is_empty(&port->tx_fifo))
     {
-        hrtimer_start(&tx_hrtimer, ktime_set(0, bit_duration * 1000), HRTIMER_MODE_REL);
+        spin_unlock_irqrestore(&port->tx_lock, flags);
+        return;
     }
+    port->tx_in_progress = 1;
+    port->tx_bit_pos = 0;
+    spin_unlock_irqrestore(&port->tx_lock, flags);
+
+    // Ensure GPIO is in idle state (stop bit = 1)
+    gpio_set_value(port->uart_params.txPin, 1);
+    hrtimer_start(&port->tx_hrtimer, ktime_set(0, port->bit_duration * 1000), HRTIMER_MODE_REL);
 }
 
 static irqreturn_t rx_irq_handler(int irq, void *dev_id)
 {
-    disable_irq_nosync(rx_gpio_irq); // Disable gpio interrupt to avoid multiple triggers
+    struct soft_uart *port = dev_id;
+
+    disable_irq_nosync(port->rx_gpio_irq); // Disable gpio interrupt to avoid multiple triggers
     // Start bit detected.
-    hrtimer_start(&rx_hrtimer, ktime_set(0, bit_duration * 1000), HRTIMER_MODE_REL);
+    hrtimer_start(&port->rx_hrtimer, ktime_set(0, port->bit_duration * 1000), HRTIMER_MODE_REL);
     return IRQ_HANDLED;
 }
 
 static enum hrtimer_restart rx_hrtimer_handler(struct hrtimer *timer)
 {
-    static char current_byte = 0;
+    struct soft_uart *port = container_of(timer, struct soft_uart, rx_hrtimer);
 
     // Read data bits
-    current_byte >>= 1;
-    if (gpio_get_value(uart_params.rxPin))
+    port->rx_current_byte >>= 1;
+    if (gpio_get_value(port->uart_params.rxPin))
     {
-        current_byte |= 0x80;
+        port->rx_current_byte |= 0x80;
     }
 
-    rx_bit_pos++;
+    port->rx_bit_pos++;
 
-    if (rx_bit_pos < 8)
+    if (port->rx_bit_pos < 8)
     {
         // Read next bit
-        hrtimer_forward_now(&rx_hrtimer, ktime_set(0, bit_duration * 1000));
+        hrtimer_forward_now(timer, ktime_set(0, port->bit_duration * 1000));
         return HRTIMER_RESTART;
     }
     else 
     {
-        rx_buffer[rx_buffer_pos++] = current_byte;
-        current_byte = 0;
-        rx_bit_pos = 0; // Reset bit position
-        enable_irq(rx_gpio_irq); // Re-enable GPIO interrupt for the next byte
+        // Single producer, no lock needed against read().
+        if (kfifo_put(&port->rx_fifo, port->rx_current_byte))
+        {
+            port->rx_bytes++;
+            wake_up_interruptible(&port->rx_wq);
+        }
+        else
+        {
+            port->rx_overruns++;
+            pr_warn_ratelimited("%s: RX ring full, byte dropped\n", port->name);
+        }
+        port->rx_current_byte = 0;
+        port->rx_bit_pos = 0; // Reset bit position
+        enable_irq(port->rx_gpio_irq); // Re-enable GPIO interrupt for the next byte
         return HRTIMER_NORESTART;
     }
 }
 
 static int open(struct inode *inode, struct file *file)
 {
-    pr_info("softwareUART device file opened.\n");
-    return 0; // No need to any operation for now.
+    struct soft_uart *port = container_of(file->private_data, struct soft_uart, miscDevice);
+
+    // One user per port, a second one would reconfigure the pins under the first.
+    mutex_lock(&ports_lock);
+    if (port->isDying)
+    {
+        mutex_unlock(&ports_lock);
+        return -ENODEV;
+    }
+    if (port->isOpen)
+    {
+        mutex_unlock(&ports_lock);
+        return -EBUSY;
+    }
+    port->isOpen = 1;
+    mutex_unlock(&ports_lock);
+
+    file->private_data = port;
+    pr_info("%s device file opened.\n", port->name);
+    return 0;
 }
 
 static int close(struct inode *inode, struct file *file)
 {
-    pr_info("softwareUART device file closed.\n");
-    if (isInit)
+    struct soft_uart *port = file->private_data;
+
+    pr_info("%s device file closed.\n", port->name);
+    mutex_lock(&port->lock);
+    releasePeripherals(port);
+
+    // Timers and IRQ are gone, the next user starts empty.
+    kfifo_reset(&port->rx_fifo);
+    kfifo_reset(&port->tx_fifo);
+    port->tx_in_progress = 0;
+    port->rx_bytes = 0;
+    port->tx_bytes = 0;
+    port->rx_overruns = 0;
+    mutex_unlock(&port->lock);
+
+    mutex_lock(&ports_lock);
+    port->isOpen = 0;
+    mutex_unlock(&ports_lock);
+
+    return 0;
+}
+
+static const struct file_operations miscDeviceFileOperations;
+
+static struct soft_uart *createPort(int index)
+{
+    struct soft_uart *port;
+    int ret;
+
+    port = kzalloc(sizeof(*port), GFP_KERNEL);
+    if (!port)
+        return ERR_PTR(-ENOMEM);
+
+    // Port 0 keeps the name of the single UART of earlier versions.
+    if (index)
+        snprintf(port->name, sizeof(port->name), "softwareUART%d", index);
+    else
+        strscpy(port->name, "softwareUART", sizeof(port->name));
+    port->index = index;
+    mutex_init(&port->lock);
+    mutex_init(&port->read_lock);
+    mutex_init(&port->write_lock);
+    INIT_KFIFO(port->tx_fifo);
+    INIT_KFIFO(port->rx_fifo);
+    spin_lock_init(&port->tx_lock);
+    init_waitqueue_head(&port->tx_wq);
+    init_waitqueue_head(&port->rx_wq);
+
+    port->miscDevice.minor = MISC_DYNAMIC_MINOR;
+    port->miscDevice.name = port->name;
+    port->miscDevice.fops = &miscDeviceFileOperations;
+
+    // Register device with kernel.
+    ret = misc_register(&port->miscDevice);
+    if (ret != 0)
+    {
+        pr_err("Could not register misc device : %s\n", port->name);
+        kfree(port);
+        return ERR_PTR(ret);
+    }
+
+    // Device info.
+    pr_info("%s device got minor %d\n", port->name, port->miscDevice.minor);
+
+    return port;
+}
+
+static void destroyPort(struct soft_uart *port)
+{
+    // Unregister device from kernel
+    misc_deregister(&port->miscDevice);
+    releasePeripherals(port);
+    pr_info("%s device removed\n", port->name);
+    kfree(port);
+}
+
+static int addPort(void)
+{
+    struct soft_uart *port;
+    int index;
+
+    mutex_lock(&ports_lock);
+    for (index = 1; index < MAX_PORTS; index++)
+        if (!ports[index])
+            break;
+
+    if (index == MAX_PORTS)
+    {
+        mutex_unlock(&ports_lock);
+        return -ENOSPC;
+    }
+
+    port = createPort(index);
+    if (IS_ERR(port))
+    {
+        mutex_unlock(&ports_lock);
+        return PTR_ERR(port);
+    }
+    ports[index] = port;
+    mutex_unlock(&ports_lock);
+
+    return index;
+}
+
+static int removePort(int index)
+{
+    struct soft_uart *port;
+
+    // Port 0 lives as long as the module.
+    if (index <= 0 || index >= MAX_PORTS)
+        return -EINVAL;
+
+    mutex_lock(&ports_lock);
+    port = ports[index];
+    if (!port || port->isOpen)
     {
-        free_irq(rx_gpio_irq, NULL);
-        gpio_free(uart_params.txPin);
-        gpio_free(uart_params.rxPin);
-        hrtimer_cancel(&tx_hrtimer);
-        hrtimer_cancel(&rx_hrtimer);
-        isInit = 0;
+        mutex_unlock(&ports_lock);
+        return port ? -EBUSY : -ENODEV;
     }
+    // An open() already past the misc lookup fails on isDying, misc_deregister()
+    // waits for it to return, so the port is only freed after that.
+    port->isDying = 1;
+    ports[index] = NULL;
+    mutex_unlock(&ports_lock);
 
-    return 0; // No need to any operation for now.
+    destroyPort(port);
+    return 0;
+}
+
+// UART_ADD_PORT and UART_REMOVE_PORT, from the control node or any port.
+static long portIoctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int index;
+
+    switch (cmd)
+    {
+    case UART_ADD_PORT:
+    {
+        index = addPort();
+        if (index < 0)
+            return index;
+
+        if (put_user(index, (int __user *)arg))
+        {
+            removePort(index);
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case UART_REMOVE_PORT:
+    {
+        if (get_user(index, (int __user *)arg))
+            return -EFAULT;
+
+        return removePort(index);
+    }
+    }
+
+    return -ENOTTY;
 }
 
 static long ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-    int bytes = 0;
+    struct soft_uart *port = file->private_data;
+    int ret;
+
     switch (cmd)
     {
     case UART_CONFIG:
     {
-        bytes = copy_from_user(&uart_params, (UARTConfig *)arg, sizeof(UARTConfig));
-        if (bytes < 0)
+        UARTConfig uart_params;
+
+        if (copy_from_user(&uart_params, (UARTConfig *)arg, sizeof(UARTConfig)))
         {
             return -EFAULT;
         }
-        pr_info("TX Pin: %d\n", uart_params.txPin);
-        pr_info("RX Pin: %d\n", uart_params.rxPin);
-        pr_info("Baud Rate: %d\n", uart_params.baudRate);
+        pr_info("%s: TX Pin: %d\n", port->name, uart_params.txPin);
+        pr_info("%s: RX Pin: %d\n", port->name, uart_params.rxPin);
+        pr_info("%s: Baud Rate: %d\n", port->name, uart_params.baudRate);
         pr_info("(Not implemented) Data Bits: %d\n", uart_params.dataBits);
         pr_info("(Not implemented) Stop Bits: %d\n", uart_params.stopBits);
         pr_info("(Not implemented) Parity: %d\n", uart_params.parity);
         pr_info("(Not implemented) Inverted: %c\n", uart_params.isInverted);
 
-        return (initPeripherals(&uart_params));
-    }  
+        // Configuring again gives the old pins back first, queued TX bytes
+        // go out with the new settings.
+        mutex_lock(&port->write_lock);
+        mutex_lock(&port->lock);
+        releasePeripherals(port);
+        port->tx_in_progress = 0;
+        port->uart_params = uart_params;
+        ret = initPeripherals(port);
+        if (!ret)
+            start_tx(port);
+        mutex_unlock(&port->lock);
+        mutex_unlock(&port->write_lock);
+        return ret;
+    }
+    case UART_ADD_PORT:
+    case UART_REMOVE_PORT:
+        return portIoctl(file, cmd, arg);
+    case UART_GET_STATS:
+    {
+        UARTStats stats =
+        {
+            .rxBytes    = READ_ONCE(port->rx_bytes),
+            .txBytes    = READ_ONCE(port->tx_bytes),
+            .rxOverruns = READ_ONCE(port->rx_overruns),
+        };
+
+        if (copy_to_user((UARTStats __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    }
     }
 
     return -1;
 }
 
+// Blocks until at least one byte arrived, unless O_NONBLOCK.
 static ssize_t read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-    int bytes_to_read = 0;
+    struct soft_uart *port = file->private_data;
+    unsigned int copied;
+    int ret;
 
-    // Check if there is data to read
-    if (rx_buffer_pos == 0)
-        return 0; // No data available
+    if (!count)
+        return 0;
 
-    // Determine the number of bytes to read
-    bytes_to_read = min(count, (size_t)rx_buffer_pos);
+    mutex_lock(&port->read_lock);
+    while (kfifo_is_empty(&port->rx_fifo))
+    {
+        mutex_unlock(&port->read_lock);
+
+        // Nothing would ever arrive.
+        if (!READ_ONCE(port->isInit))
+            return -EIO;
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
 
-    // Copy data to userspace
-    if (copy_to_user(buf, rx_buffer, bytes_to_read))
-        return -1;
+        ret = wait_event_interruptible(port->rx_wq, !kfifo_is_empty(&port->rx_fifo) ||
+                                                    !READ_ONCE(port->isInit));
+        if (ret)
+            return ret;
+
+        mutex_lock(&port->read_lock);
+    }
 
-    // Shift remaining data in the buffer
-    memmove(rx_buffer, rx_buffer + bytes_to_read, rx_buffer_pos - bytes_to_read);
-    rx_buffer_pos -= bytes_to_read;
+    // Copy data to userspace, the ring is not touched by anyone else on this side.
+    ret = kfifo_to_user(&port->rx_fifo, buf, count, &copied);
+    mutex_unlock(&port->read_lock);
 
-    return bytes_to_read;
+    return ret ? ret : copied;
 }
 
+// Queues everything, blocking while the ring is full unless O_NONBLOCK.
 static ssize_t write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
-    // Check if there is enough space in the buffer
-    if (count > sizeof(tx_buffer))
-        return -1; // Not enough space
+    struct soft_uart *port = file->private_data;
+    unsigned int copied;
+    size_t queued = 0;
+    int ret = 0;
 
-    // Copy data from userspace
-    if (copy_from_user(tx_buffer, buf, count))
-        return -1;
+    mutex_lock(&port->write_lock);
+    while (queued < count)
+    {
+        if (!READ_ONCE(port->isInit))
+        {
+            ret = -EIO;
+            break;
+        }
+
+        // Copy data from userspace, as much as fits.
+        ret = kfifo_from_user(&port->tx_fifo, buf + queued, count - queued, &copied);
+        if (ret)
+            break;
+        queued += copied;
+        start_tx(port);
+
+        if (queued == count)
+            break;
 
-    // Set the buffer length and start transmission
-    tx_buffer_len = count;
-    start_tx();
+        if (file->f_flags & O_NONBLOCK)
+        {
+            ret = -EAGAIN;
+            break;
+        }
 
-    return count;
+        // Not held while asleep, UART_CONFIG would wait for the ring to drain.
+        mutex_unlock(&port->write_lock);
+        ret = wait_event_interruptible(port->tx_wq, !kfifo_is_full(&port->tx_fifo) ||
+                                                    !READ_ONCE(port->isInit));
+        if (ret)
+            return queued ? queued : ret;
+        mutex_lock(&port->write_lock);
+    }
+    mutex_unlock(&port->write_lock);
+
+    return queued ? queued : ret;
+}
+
+static __poll_t poll(struct file *file, poll_table *wait)
+{
+    struct soft_uart *port = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &port->rx_wq, wait);
+    poll_wait(file, &port->tx_wq, wait);
+
+    if (!kfifo_is_empty(&port->rx_fifo))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    if (!kfifo_is_full(&port->tx_fifo))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
 }
 
 static const struct file_operations miscDeviceFileOperations =
@@ -302,46 +654,57 @@ static const struct file_operations miscDeviceFileOperations =
     .unlocked_ioctl = ioctl,
     .read = read,
     .write = write,
+    .poll = poll,
+};
+
+static const struct file_operations controlFileOperations =
+{
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = portIoctl,
 };
 
-static struct miscdevice miscDevice =
+// Any number of users, it owns no pins.
+static struct miscdevice controlDevice =
 {
     .minor = MISC_DYNAMIC_MINOR,
-    .name = "softwareUART",
-    .fops = &miscDeviceFileOperations,
+    .name = CONTROL_NAME,
+    .fops = &controlFileOperations,
 };
 
 static int __init init(void)
 {
-    // Register device with kernel.
-    int ret = misc_register(&miscDevice);
+    struct soft_uart *port = createPort(0);
+    int ret;
+
+    if (IS_ERR(port))
+        return PTR_ERR(port);
+    ports[0] = port;
+
+    ret = misc_register(&controlDevice);
     if (ret != 0)
     {
-        pr_err("Could not register misc device : %s\n", miscDevice.name);
+        pr_err("Could not register misc device : %s\n", CONTROL_NAME);
+        destroyPort(port);
+        ports[0] = NULL;
         return ret;
     }
 
-    // Device info.
-    pr_info("%s device got minor %d\n", miscDevice.name, miscDevice.minor);
-
     return 0;
 }
 
 static void __exit customExit(void)
 {
-    pr_info("softwareUART device removed\n");
-    
-    // Unregister device from kernel
-    misc_deregister(&miscDevice);
+    int index;
+
+    // No more ports come or go from here on.
+    misc_deregister(&controlDevice);
 
-    if (isInit)
+    // Nobody can have a port open while the module goes away.
+    for (index = MAX_PORTS - 1; index >= 0; index--)
     {
-        free_irq(rx_gpio_irq, NULL);
-        gpio_free(uart_params.txPin);
-        gpio_free(uart_params.rxPin);
-        hrtimer_cancel(&tx_hrtimer);
-        hrtimer_cancel(&rx_hrtimer);
-        isInit = 0;
+        if (ports[index])
+            destroyPort(ports[index]);
+        ports[index] = NULL;
     }
 }
 
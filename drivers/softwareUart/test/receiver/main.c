@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -23,10 +24,11 @@ typedef struct
     char isInverted;
 } UARTConfig;
 
-int main()
+int main(int argc, char *argv[])
 {
-    // Open the device file
-    int fd = open("/dev/softwareUART", O_RDWR);
+    // Open the device file, /dev/softwareUART<n> for ports added with UART_ADD_PORT on /dev/softwareUART-ctl
+    const char *device = argc > 1 ? argv[1] : "/dev/softwareUART";
+    int fd = open(device, O_RDWR);
     if (fd < 0)
     {
         perror("Failed to open the device file");
@@ -53,19 +55,20 @@ int main()
 
     while(1)
     {
-        // Read from file and print it to terminal
+        // Read from file and print it to terminal, read() blocks until data arrives.
         char buffer[32];
         
-        int bytes = read(fd, buffer, sizeof(buffer));
-        if (bytes > 0)
+        int bytes = read(fd, buffer, sizeof(buffer) - 1);
+        if (bytes < 0)
         {
-            buffer[bytes] = '\0';
-            printf("Received: %s\n", buffer);
+            perror("Failed to read from the device file");
+            break;
         }
-
-        // Wait for a while
-        sleep(1);
+        buffer[bytes] = '\0';
+        printf("Received: %s\n", buffer);
     }
 
+    close(fd);
+
     return 0;
 }
\ No newline at end of file
@@ -24,10 +24,11 @@ typedef struct
 } UARTConfig;
 
 
-int main()
+int main(int argc, char *argv[])
 {
-    // Open the device file
-    int fd = open("/dev/softwareUART", O_RDWR);
+    // Open the device file, /dev/softwareUART<n> for ports added with UART_ADD_PORT on /dev/softwareUART-ctl
+    const char *device = argc > 1 ? argv[1] : "/dev/softwareUART";
+    int fd = open(device, O_RDWR);
     if (fd < 0)
     {
         perror("Failed to open the device file");